@@ -6,158 +6,800 @@
 #include <linux/fs.h>
 #include <linux/blk_types.h>
 #include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
 
 #include "csl.h"
 
+static unsigned int backup_merge = CSL_BACKUP_MERGE;
+module_param(backup_merge, uint, 0644);
+MODULE_PARM_DESC(backup_merge, "incremental backups taken before the next full one, 0 for full backups only");
+
+static bool lazy_restore = false;
+module_param(lazy_restore, bool, 0444);
+MODULE_PARM_DESC(lazy_restore, "restore only the mapping at load, data is read from the backup on first access or by a prefetcher");
+
+static bool rebuild_l2p = false;
+module_param(rebuild_l2p, bool, 0444);
+MODULE_PARM_DESC(rebuild_l2p, "rebuild the mapping from the LBA tags of the sectors instead of the L2P entries of the backup");
+
+/* Full backups alternate between two slots, so a torn one never replaces the last complete one */
+static const char *csl_full_path[2] = { BACKUP_FILE_PATH, BACKUP_FILE_PATH ".1" };
+
 /*
-* read_from_file() - Get Data From filename
-* @filename : target file name
+* csl_backup_mark_seg() : remember a segment whose data or free_map changed
+* @seg : the segment index
+*
+* Called under the shard lock for every allocation, so check before the atomic set.
+*/
+void csl_backup_mark_seg(unsigned int seg)
+{
+	if(!test_bit(seg, dev->dirty_segs)) set_bit(seg, dev->dirty_segs);
+}
+
+/*
+* csl_backup_mark_l2p() : remember the L2P block of a changed LBA
+* @lba : the logical sector number, a piece of one stripe never crosses a block
+*/
+void csl_backup_mark_l2p(unsigned int lba)
+{
+	unsigned int block = lba / CSL_L2P_BLOCK;
+
+	if(!test_bit(block, dev->dirty_l2p)) set_bit(block, dev->dirty_l2p);
+}
+
+/*
+* csl_backup_mark_oob() : remember a segment whose tags changed
+* @seg : the segment index
+*
+* Called under the shard lock when a sector is invalidated. A segment whose data changed
+* goes to the next delta with its tags anyway.
+*/
+void csl_backup_mark_oob(unsigned int seg)
+{
+	if(!test_bit(seg, dev->dirty_oob)) set_bit(seg, dev->dirty_oob);
+}
+
+/*
+* csl_seg_io() : read or write the data of a segment at the position of a file
+* @file : opened file
+* @seg : the segment index, it must have backing chunks
+* @pos : offset in the file, advanced by the segment size
+* @isWrite : write the segment to the file if set, read it from the file if not
+*
+* A segment may span several chunks, each contiguous run is one file access.
+* A compressed page is written through a bounce page, a segment is read only before it is compressed.
+*/
+static int csl_seg_io(struct file *file, unsigned int seg, loff_t *pos, int isWrite)
+{
+	unsigned int ppn = seg * CSL_SEGMENT_SECTORS;
+	unsigned int run = min(CSL_SEGMENT_SECTORS, 1U << dev->chunk_shift);
+	void *bounce = NULL;
+	unsigned int i;
+	int ret = SUCCESS_EXIT;
+
+	for(i = 0; i < CSL_SEGMENT_SECTORS && ret >= 0; i += run){
+		if(!isWrite){
+			ret = read_from_file(file, csl_sector_addr(ppn + i), run * SECTOR_SIZE, pos);
+			continue;
+		}
+
+		/* The segment is pinned, so its raw chunks stay until it is written */
+		if(READ_ONCE(dev->chunks[(ppn + i) >> dev->chunk_shift])){
+			ret = write_to_file(file, csl_sector_addr(ppn + i), run * SECTOR_SIZE, pos);
+			continue;
+		}
+
+		if(bounce == NULL) bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if(bounce == NULL){
+			pr_warn(MALLOC_ERROR_MSG);
+			ret = FAIL_EXIT;
+			break;
+		}
+		csl_copy_out(ppn + i, bounce, run);
+		ret = write_to_file(file, bounce, run * SECTOR_SIZE, pos);
+	}
+
+	kfree(bounce);
+	return ret < 0 ? FAIL_EXIT : SUCCESS_EXIT;
+}
+
+/*
+* read_from_file() - Read the next part of a file
+* @file : opened file
 * @data : pointer of data array
 * @size : size of data
+* @pos : offset in the file, advanced by size
 */
 
-int read_from_file(char* filename, void* data, size_t size)
-{	
-	struct file* file;
-	loff_t pos = 0;
+int read_from_file(struct file* file, void* data, size_t size, loff_t *pos)
+{
+	if(kernel_read(file, data, size, pos) != size){
+		pr_warn(FILE_READ_ERROR_MSG);
+		return FAIL_EXIT;
+	}
+
+	return SUCCESS_EXIT;
+}
 
-	file = filp_open(filename, O_RDONLY, 0644);
 
-	if(IS_ERR(file)|| file == NULL){
-		pr_warn(FILE_OPEN_ERROR_MSG);
+/*
+* csl_seg_lazy() : check the data of a segment is still in the backup files
+* @seg : the segment index
+*
+* A segment leaves lazy_map once and never comes back, new data never goes to a lazy segment.
+*/
+bool csl_seg_lazy(unsigned int seg)
+{
+	return READ_ONCE(dev->lazy_left) && test_bit_acquire(seg, dev->lazy_map);
+}
+
+/*
+* csl_lazy_needed() : check some LBAs are mapped to lazy segments
+* @lba : the start sector number
+* @nr : how many sectors
+*/
+bool csl_lazy_needed(unsigned int lba, unsigned int nr)
+{
+	unsigned int i;
+	u32 ppn;
+
+	if(!READ_ONCE(dev->lazy_left)) return false;
+
+	for(i = 0; i < nr; i++){
+		ppn = READ_ONCE(dev->l2p[lba + i]);
+		if(csl_l2p_mapped(ppn) && csl_seg_lazy(ppn / CSL_SEGMENT_SECTORS)) return true;
+	}
+
+	return false;
+}
+
+/*
+* csl_lazy_load() : read the data of a lazy segment from the backup files
+* @seg : the segment index
+*
+* The segment leaves lazy_map only after its data is in, readers test it with acquire.
+* The files are closed once the last segment is in.
+* return : SUCCESS_EXIT, or FAIL_EXIT if it could not be read
+*/
+static int csl_lazy_load(unsigned int seg)
+{
+	struct file *file;
+	loff_t pos;
+	int ret = SUCCESS_EXIT;
+
+	mutex_lock(&dev->lazy_mutex);
+	if(!test_bit(seg, dev->lazy_map)) goto out;
+
+	pos = dev->lazy_src[seg] & ~CSL_LAZY_DELTA;
+	file = dev->lazy_file[(dev->lazy_src[seg] & CSL_LAZY_DELTA) ? 1 : 0];
+
+	if(csl_alloc_backing(&dev->segs[seg], GFP_KERNEL) < 0 || csl_seg_io(file, seg, &pos, 0) < 0){
+		pr_warn("CSL : FAIL TO RESTORE SEGMENT %u", seg);
+		ret = FAIL_EXIT;
+		goto out;
+	}
+
+	clear_bit_unlock(seg, dev->lazy_map);
+	WRITE_ONCE(dev->lazy_left, dev->lazy_left - 1);
+
+	if(dev->lazy_left == 0){
+		pr_info("CSL : LAZY RESTORE COMPLETE");
+		if(dev->lazy_file[0]) filp_close(dev->lazy_file[0], NULL);
+		if(dev->lazy_file[1]) filp_close(dev->lazy_file[1], NULL);
+		dev->lazy_file[0] = NULL;
+		dev->lazy_file[1] = NULL;
+	}
+
+out:
+	mutex_unlock(&dev->lazy_mutex);
+	return ret;
+}
+
+/*
+* csl_lazy_load_lbas() : read the lazy segments which some LBAs are mapped to
+* @lba : the start sector number
+* @nr : how many sectors
+*
+* Sleeps, so it is for work items and not for queue_rq.
+*/
+int csl_lazy_load_lbas(unsigned int lba, unsigned int nr)
+{
+	unsigned int i;
+	u32 ppn;
+
+	for(i = 0; i < nr && READ_ONCE(dev->lazy_left); i++){
+		ppn = READ_ONCE(dev->l2p[lba + i]);
+		if(!csl_l2p_mapped(ppn) || !csl_seg_lazy(ppn / CSL_SEGMENT_SECTORS)) continue;
+
+		if(csl_lazy_load(ppn / CSL_SEGMENT_SECTORS) < 0) return FAIL_EXIT;
+	}
+
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_lazy_load_all() : read every lazy segment, before the backup files are rewritten
+*/
+static int csl_lazy_load_all(void)
+{
+	unsigned int seg;
+
+	for(seg = 0; seg < dev->segment_num && READ_ONCE(dev->lazy_left); seg++){
+		if(!csl_seg_lazy(seg)) continue;
+		if(csl_lazy_load(seg) < 0) return FAIL_EXIT;
+	}
+
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_lazy_defer_rq() : run a read after its segments are loaded
+* @rq : the read, it touches a lazy segment
+*/
+void csl_lazy_defer_rq(struct request *rq)
+{
+	spin_lock(&dev->lazy_lock);
+	list_add_tail(&rq->queuelist, &dev->lazy_rqs);
+	spin_unlock(&dev->lazy_lock);
+
+	queue_work(system_unbound_wq, &dev->lazy_work);
+}
+
+/*
+* csl_lazy_serve() : load the segments of the deferred reads and complete them
+*/
+static void csl_lazy_serve(void)
+{
+	struct request *rq, *tmp;
+	blk_status_t status;
+	LIST_HEAD(rqs);
+
+	spin_lock(&dev->lazy_lock);
+	list_splice_init(&dev->lazy_rqs, &rqs);
+	spin_unlock(&dev->lazy_lock);
+
+	list_for_each_entry_safe(rq, tmp, &rqs, queuelist){
+		list_del_init(&rq->queuelist);
+
+		if(csl_lazy_load_lbas(blk_rq_pos(rq), blk_rq_sectors(rq)) < 0) status = BLK_STS_IOERR;
+		else status = csl_get_request(rq, NULL);
+
+		blk_mq_end_request(rq, status);
+	}
+}
+
+/*
+* csl_lazy_work() : serve deferred reads and prefetch the rest of the segments
+* @work : dev->lazy_work
+*
+* Deferred reads go first, between every two segments prefetched.
+* If a segment can not be read, prefetching stops and only reads of it fail.
+*/
+void csl_lazy_work(struct work_struct *work)
+{
+	unsigned int seg;
+
+	while(READ_ONCE(dev->lazy_left)){
+		csl_lazy_serve();
+
+		seg = find_next_bit(dev->lazy_map, dev->segment_num, dev->lazy_cursor);
+		if(seg >= dev->segment_num) seg = find_first_bit(dev->lazy_map, dev->segment_num);
+		if(seg >= dev->segment_num) break;
+
+		if(csl_lazy_load(seg) < 0) break;
+		dev->lazy_cursor = seg + 1;
+
+		cond_resched();
+	}
+
+	csl_lazy_serve();
+}
+
+/*
+* csl_lazy_exit() : free the lazy restore state
+* @dev : the device
+*/
+void csl_lazy_exit(struct csl_dev *dev)
+{
+	cancel_work_sync(&dev->lazy_work);
+
+	if(dev->lazy_file[0]) filp_close(dev->lazy_file[0], NULL);
+	if(dev->lazy_file[1]) filp_close(dev->lazy_file[1], NULL);
+	dev->lazy_file[0] = NULL;
+	dev->lazy_file[1] = NULL;
+
+	bitmap_free(dev->lazy_map);
+	kvfree(dev->lazy_src);
+	dev->lazy_map = NULL;
+	dev->lazy_src = NULL;
+	dev->lazy_left = 0;
+}
+
+/*
+* csl_restore_delta() : apply the deltas on top of the full backup
+* @dev : the device, the full backup is already restored
+* @epoch : epoch of the full backup, updated to the one of the last delta applied
+* @rebuild : set if an L2P entry is out of range, the mapping must be rebuilt from the tags
+*
+* A delta is applied only if it is the next epoch and its trailer is there,
+* so a delta torn by a crash and anything after it is ignored.
+* return : SUCCESS_EXIT, or FAIL_EXIT if a complete delta could not be applied
+*/
+static int csl_restore_delta(struct csl_dev *dev, u32 *epoch, bool *rebuild)
+{
+	struct csl_delta_hdr hdr;
+	struct file *file;
+	loff_t pos = 0, off;
+	u32 trailer[2];
+	u32 idx;
+	bool no_data;
+	unsigned int i, j;
+	u32 *l2p;
+	int ret = FAIL_EXIT;
+
+	dev->nr_deltas = 0;
+	dev->delta_pos = 0;
+
+	file = filp_open(DELTA_FILE_PATH, O_RDONLY | O_LARGEFILE, 0644);
+	if(IS_ERR(file)) return SUCCESS_EXIT;
+
+	while(1){
+		off = pos;
+		if(kernel_read(file, &hdr, sizeof(hdr), &off) != sizeof(hdr)) break;
+		if(hdr.magic != CSL_DELTA_MAGIC || hdr.epoch != *epoch + 1) break;
+		if(hdr.length < sizeof(hdr) + sizeof(trailer)) break;
+
+		off = pos + hdr.length - sizeof(trailer);
+		if(kernel_read(file, trailer, sizeof(trailer), &off) != sizeof(trailer)) break;
+		if(trailer[0] != CSL_DELTA_MAGIC || trailer[1] != hdr.epoch) break;
+
+		// 1. L2P blocks go straight to the table
+		off = pos + sizeof(hdr);
+		for(i = 0; i < hdr.nr_blocks; i++){
+			if(read_from_file(file, &idx, sizeof(idx), &off) < 0) goto out;
+			if(idx >= dev->lba_num / CSL_L2P_BLOCK) goto out;
+
+			l2p = dev->l2p + idx * CSL_L2P_BLOCK;
+			if(read_from_file(file, l2p, CSL_L2P_BLOCK * sizeof(u32), &off) < 0) goto out;
+
+			for(j = 0; j < CSL_L2P_BLOCK; j++){
+				if(!csl_l2p_mapped(l2p[j]) && l2p[j] != CSL_UNMAPPED && l2p[j] != CSL_ZERO){
+					l2p[j] = CSL_UNMAPPED;
+					*rebuild = true;
+				}
+			}
+		}
+
+		// 2. Segments with their sequence and tags, and data if they are in use and it changed
+		for(i = 0; i < hdr.nr_segs; i++){
+			if(read_from_file(file, &idx, sizeof(idx), &off) < 0) goto out;
+			no_data = idx & CSL_DELTA_NO_DATA;
+			idx &= ~CSL_DELTA_NO_DATA;
+			if(idx >= dev->segment_num) goto out;
+
+			if(read_from_file(file, dev->free_map + BIT_WORD(idx * CSL_SEGMENT_SECTORS), CSL_SEG_MAP_SIZE, &off) < 0) goto out;
+			if(read_from_file(file, &dev->segs[idx].seq, sizeof(u64), &off) < 0) goto out;
+			if(read_from_file(file, dev->p2l + idx * CSL_SEGMENT_SECTORS, CSL_OOB_TAG_SIZE, &off) < 0) goto out;
+			if(no_data || bitmap_empty(dev->free_map + BIT_WORD(idx * CSL_SEGMENT_SECTORS), CSL_SEGMENT_SECTORS)) continue;
+
+			/* Lazy restore only remembers where the data is */
+			if(dev->lazy_src){
+				dev->lazy_src[idx] = off | CSL_LAZY_DELTA;
+				off += CSL_SEGMENT_SECTORS * SECTOR_SIZE;
+				continue;
+			}
+
+			if(csl_alloc_backing(&dev->segs[idx], GFP_KERNEL) < 0){
+				pr_warn(MALLOC_ERROR_MSG);
+				goto out;
+			}
+			if(csl_seg_io(file, idx, &off, 0) < 0) goto out;
+		}
+
+		*epoch = hdr.epoch;
+		dev->nr_deltas++;
+		pos += hdr.length;
+	}
+
+	dev->delta_pos = pos;
+	ret = SUCCESS_EXIT;
+
+	/* Lazy segments may be read from it later */
+	if(dev->lazy_src && dev->nr_deltas){
+		dev->lazy_file[1] = file;
+		return ret;
+	}
+
+out:
+	if(ret < 0) pr_warn(FILE_READ_ERROR_MSG);
+	filp_close(file, NULL);
+	return ret;
+}
+
+/* A shard whose mapping is rebuilt by a work item */
+struct csl_rebuild{
+	struct work_struct work;
+	struct csl_shard *shard;
+	unsigned int nr;	// LBAs mapped
+	unsigned int shared;	// LBAs which map a sector tagged with another LBA
+};
+
+/*
+* csl_sector_newer() : check a sector was allocated after another one of the same shard
+* @ppn : the sector
+* @old : the other sector
+*
+* Segments are opened in the order of their sequence, and sectors of a segment are allocated in order.
+*/
+static bool csl_sector_newer(unsigned int ppn, unsigned int old)
+{
+	u64 seq = dev->segs[ppn / CSL_SEGMENT_SECTORS].seq;
+	u64 seq_old = dev->segs[old / CSL_SEGMENT_SECTORS].seq;
+
+	if(seq != seq_old) return seq > seq_old;
+	return ppn > old;
+}
+
+/*
+* csl_rebuild_shard() : rebuild the mapping of a shard from the tags of its used sectors
+* @work : csl_rebuild.work
+*
+* Every copy of an LBA is in the region of its shard, so shards are rebuilt in parallel
+* and never touch the same L2P entry. Of two sectors tagged with one LBA, the newer wins.
+*
+* A sector which LBAs share with dedup is tagged with one of them only, the others can not be found
+* from the tags. They are counted from the entries of the backup first, which are cleared then.
+*/
+static void csl_rebuild_shard(struct work_struct *work)
+{
+	struct csl_rebuild *rb = container_of(work, struct csl_rebuild, work);
+	unsigned int nr_blocks = dev->lba_num / CSL_L2P_BLOCK;
+	unsigned int end = rb->shard->base + dev->shard_sector_num;
+	unsigned int ppn = rb->shard->base;
+	unsigned int block, i;
+	u32 lba, old;
+
+	/* A block of the mapping is one stripe, the stripes of the shard are every CSL_NR_SHARDS */
+	for(block = rb->shard - dev->shards; block < nr_blocks; block += CSL_NR_SHARDS){
+		for(i = 0, lba = block * CSL_L2P_BLOCK; i < CSL_L2P_BLOCK; i++, lba++){
+			old = dev->l2p[lba];
+			if(csl_l2p_mapped(old) && test_bit(old, dev->free_map) && dev->p2l[old] != lba) rb->shared++;
+			dev->l2p[lba] = CSL_UNMAPPED;
+		}
+		cond_resched();
+	}
+
+	for_each_set_bit_from(ppn, dev->free_map, end){
+		lba = dev->p2l[ppn];
+		if(lba >= dev->lba_num || csl_get_shard(lba) != rb->shard) continue;
+
+		old = dev->l2p[lba];
+		if(old == CSL_UNMAPPED) rb->nr++;
+		else if(!csl_sector_newer(ppn, old)) continue;
+
+		dev->l2p[lba] = ppn;
+		cond_resched();
+	}
+}
+
+/*
+* csl_rebuild_l2p() : rebuild the whole mapping from the tags of the sectors
+* @dev : the device, free_map, the tags and the sequence of the segments are restored
+*
+* One work item per shard on the unbound workqueue, so the scan is spread over the CPUs.
+* return : SUCCESS_EXIT, or FAIL_EXIT if there is no memory for them or LBAs share sectors,
+*          the mapping would lose LBAs then
+*/
+static int csl_rebuild_l2p(struct csl_dev *dev)
+{
+	struct csl_rebuild *rb;
+	unsigned int nr = 0, shared = 0;
+	int i;
+
+	rb = kcalloc(CSL_NR_SHARDS, sizeof(struct csl_rebuild), GFP_KERNEL);
+	if(rb == NULL){
+		pr_warn(MALLOC_ERROR_MSG);
 		return FAIL_EXIT;
 	}
-		
-	if(kernel_read(file, data, size, &pos) < 0){
-		pr_warn(FILE_READ_ERROR_MSG);
+
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		rb[i].shard = &dev->shards[i];
+		INIT_WORK(&rb[i].work, csl_rebuild_shard);
+		queue_work(system_unbound_wq, &rb[i].work);
+	}
+
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		flush_work(&rb[i].work);
+		nr += rb[i].nr;
+		shared += rb[i].shared;
+	}
+
+	kfree(rb);
+	if(shared){
+		pr_warn("CSL : %u LBAS SHARE SECTORS, THE MAPPING CAN NOT BE REBUILT FROM SECTOR TAGS", shared);
 		return FAIL_EXIT;
 	}
 
+	pr_info("CSL : REBUILT %u L2P ENTRY FROM SECTOR TAGS", nr);
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_read_oob() : read the sequence of every segment and the tags of every sector
+* @dev : the device
+* @file : the full backup
+* @buf : a CSL_BACKUP_BUF_SIZE buffer
+* @pos : offset of the sequences in the file, advanced past the tags
+*/
+static int csl_read_oob(struct csl_dev *dev, struct file *file, void *buf, loff_t *pos)
+{
+	u64 *seq = buf;
+	unsigned int i, j, nr;
+
+	for(i = 0; i < dev->segment_num; i += nr){
+		nr = min_t(unsigned int, dev->segment_num - i, CSL_BACKUP_BUF_SIZE / sizeof(u64));
+		if(read_from_file(file, seq, nr * sizeof(u64), pos) < 0) return FAIL_EXIT;
+
+		for(j = 0; j < nr; j++) dev->segs[i + j].seq = seq[j];
+	}
+
+	/* Tags go straight to the reverse map, a shard at a time */
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		if(read_from_file(file, dev->p2l + i * dev->shard_sector_num, dev->shard_sector_num * sizeof(u32), pos) < 0) return FAIL_EXIT;
+	}
+
 	return SUCCESS_EXIT;
 }
 
+/*
+* csl_open_full() : open the newest complete full backup
+* @dev : the device, full_slot is set to the slot opened
+*
+* A full backup torn by a crash has no trailer, then the one before it in the other slot is used.
+* return : the file, or NULL if there is no complete full backup
+*/
+static struct file *csl_open_full(struct csl_dev *dev)
+{
+	struct file *file[2];
+	u32 header[2], trailer[2], epoch[2];
+	loff_t size, pos;
+	int i, best = -1;
+
+	for(i = 0; i < 2; i++){
+		file[i] = filp_open(csl_full_path[i], O_RDONLY | O_LARGEFILE, 0644);
+		if(IS_ERR(file[i])){
+			file[i] = NULL;
+			continue;
+		}
+
+		// header is the capacity and the epoch
+		size = i_size_read(file_inode(file[i]));
+		if(size < sizeof(header) + sizeof(trailer)) continue;
+
+		pos = 0;
+		if(kernel_read(file[i], header, sizeof(header), &pos) != sizeof(header)) continue;
+		pos = size - sizeof(trailer);
+		if(kernel_read(file[i], trailer, sizeof(trailer), &pos) != sizeof(trailer)) continue;
+		if(trailer[0] != CSL_BACKUP_MAGIC || trailer[1] != header[1]) continue;
+
+		epoch[i] = header[1];
+		if(best < 0 || epoch[i] > epoch[best]) best = i;
+	}
+
+	for(i = 0; i < 2; i++){
+		if(file[i] && i != best) filp_close(file[i], NULL);
+	}
+
+	if(best < 0){
+		pr_warn(FILE_OPEN_ERROR_MSG);
+		return NULL;
+	}
+
+	dev->full_slot = best;
+	return file[best];
+}
 
 /*
 * csl_restore() : Get Device Backup Data
 * @dev : the struct of devcie to store data
 *
-* Find Backup File and restore it to device struct. 
-* If there is not backup file, just initilaize xarray, linked list.
+* Find the newest complete Backup File and restore it to device struct.
+* If there is not backup file, just initilaize L2P table.
+* Invalid sectors are not stored, they are found again from the L2P table by csl_init_segments().
+* Chunks are allocated only for the segments in use.
+*
+* If an L2P entry is out of range, or with rebuild_l2p, the mapping is rebuilt from the tags
+* of the sectors once the deltas are applied. Sectors shared with dedup can not be rebuilt, the restore fails then.
+*
+* The file is read once from the start. The header goes straight to dev->free_map,
+* L2P entries go through a CSL_BACKUP_BUF_SIZE buffer and data is read straight into the chunks,
+* so the extra memory does not grow with the capacity.
+* The deltas of the incremental backups are applied after it.
+*
+* With lazy_restore only the mapping is read here. Used segments are left in lazy_map with
+* the offset of their data, and dev->lazy_work starts to prefetch them while the disk is serving I/O.
+*
+* Only a missing backup starts the device empty. A backup which can not be read or applied whole,
+* or is for another capacity, fails the restore and is left as it is, so no checkpoint overwrites it.
+*
+* return : SUCCESS_EXIT, also when it starts empty without a backup, or a negative errno
+*          if the backup can not be restored whole, the device must not be used then
 */
-void csl_restore(struct csl_dev *dev)
+int csl_restore(struct csl_dev *dev)
 {
 	int i;
 
-	unsigned int xa_entry_num = 0;
+	struct file *file;
+	loff_t pos = 0, off;
+
+	unsigned int sector_num;
+	unsigned int epoch;
+	unsigned int l2p_entry_num = 0;
 	unsigned int gc_entry_num = 0;
 	unsigned int *metadata_ptr;
-	u8 *data_ptr;
+	unsigned int nr, left;
+	bool rebuild = rebuild_l2p;
+	int ret = -EIO;
 
-	struct l2b_item* l2b_item;
-	struct list_item* item;
+	size_t chunk_size = PAGE_SIZE << dev->chunk_order;
+	u32 *buf = NULL;
 
-	u8 *total_data;
-	unsigned int total_data_size;
+	if(lazy_restore){
+		dev->lazy_map = bitmap_zalloc(dev->segment_num, GFP_KERNEL);
+		dev->lazy_src = kvmalloc_array(dev->segment_num, sizeof(loff_t), GFP_KERNEL);
+		if(!dev->lazy_map || !dev->lazy_src){
+			pr_warn(MALLOC_ERROR_MSG);
+			csl_lazy_exit(dev);
+		}
+	}
 
+	file = csl_open_full(dev);
+	if(file == NULL) goto nofile;
 
-	// 1. Read offset, the number of each xarray and list entry
-	
-	void* header_data = kmalloc(BACKUP_HEADER_SIZE, GFP_KERNEL);
-	
-	if(IS_ERR(header_data) || header_data == NULL){
-		pr_warn();
-		goto nofile;
+	buf = kmalloc(CSL_BACKUP_BUF_SIZE, GFP_KERNEL);
+	if(buf == NULL){
+		pr_warn(MALLOC_ERROR_MSG);
+		ret = -ENOMEM;
+		goto fail;
 	}
 
-	if(read_from_file(BACKUP_FILE_PATH, header_data, BACKUP_HEADER_SIZE)<0){
-		pr_warn(FILE_READ_ERROR_MSG);
-		goto nofile;
+	// 1. Read capacity, epoch, offset, the number of each L2P and list entry
+
+	if(read_from_file(file, &sector_num, sizeof(sector_num), &pos) < 0) goto fail;
+	if(sector_num != dev->sector_num){
+		pr_warn("CSL : backup is for %u sectors, device has %u", sector_num, dev->sector_num);
+		ret = -EINVAL;
+		goto fail;
 	}
 
-	memcpy(dev->free_map, header_data, FREE_MAP_SIZE);
+	if(read_from_file(file, &epoch, sizeof(epoch), &pos) < 0) goto fail;
+	if(read_from_file(file, dev->free_map, FREE_MAP_SIZE(dev->sector_num), &pos) < 0) goto fail;
+	if(read_from_file(file, &l2p_entry_num, sizeof(l2p_entry_num), &pos) < 0) goto fail;
+	if(read_from_file(file, &gc_entry_num, sizeof(gc_entry_num), &pos) < 0) goto fail;
 
-	xa_entry_num = *(unsigned int*)(header_data + FREE_MAP_SIZE);
-	gc_entry_num = *(unsigned int*)(header_data + FREE_MAP_SIZE + sizeof(xa_entry_num));
-	
-	total_data_size = BACKUP_HEADER_SIZE + (xa_entry_num * XA_ENTRY_SIZE) + (gc_entry_num * GC_ENTRY_SIZE) + DEVICE_TOTAL_SIZE;
-	
-	total_data = vmalloc(total_data_size);
+	// 2. Read L2P Data a buffer at a time
 
-	if(read_from_file(BACKUP_FILE_PATH, total_data, total_data_size) < 0){
-		pr_warn(FILE_READ_ERROR_MSG);
-		goto nofile;
+	for(left = l2p_entry_num; left; left -= nr){
+		nr = min_t(unsigned int, left, CSL_BACKUP_BUF_SIZE / L2P_ENTRY_SIZE);
+		if(read_from_file(file, buf, nr * L2P_ENTRY_SIZE, &pos) < 0) goto fail;
+
+		metadata_ptr = buf;
+		for(i = 0; i < nr; i++, metadata_ptr += 2){
+			if(metadata_ptr[0] >= dev->lba_num || (!csl_l2p_mapped(metadata_ptr[1]) && metadata_ptr[1] != CSL_ZERO)){
+				if(!rebuild) pr_warn("CSL : L2P ENTRY OUT OF RANGE, REBUILD FROM SECTOR TAGS");
+				rebuild = true;
+				continue;
+			}
+			dev->l2p[metadata_ptr[0]] = metadata_ptr[1];
+		}
+	}
+
+	// 3. Skip Linked List Data written by older versions
+
+	pos += (loff_t)gc_entry_num * GC_ENTRY_SIZE;
+
+	// 4. Read the sequence of the segments and the tags of the sectors, they are after the data
+
+	if(csl_init_segments() < 0){
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	off = pos + (loff_t)dev->sector_num * SECTOR_SIZE;
+	if(csl_read_oob(dev, file, buf, &off) < 0) goto fail;
+
+	// 5. Read Actual Data, only the segments in use get chunks
+
+	if(dev->lazy_src){
+		for(i = 0; i < dev->segment_num; i++) dev->lazy_src[i] = pos + (loff_t)i * CSL_SEGMENT_SECTORS * SECTOR_SIZE;
+		goto delta;
 	}
-	
-	// 2. Read XArray Data
 
-	metadata_ptr = (unsigned int*)(total_data + BACKUP_HEADER_SIZE);
-	
-	xa_init(&dev->l2p_map);
+	for(i = 0; i < dev->segment_num; i++){
+		if(dev->segs[i].wp == 0) continue;
 
-	for(i = 0; i < xa_entry_num; i++){
-		l2b_item = kmalloc(sizeof(struct l2b_item), GFP_KERNEL);
-		if(IS_ERR(l2b_item) || l2b_item == NULL){
-			pr_warn();
-			goto nofile;
+		if(csl_alloc_backing(&dev->segs[i], GFP_KERNEL) < 0){
+			pr_warn(MALLOC_ERROR_MSG);
+			ret = -ENOMEM;
+			goto fail;
 		}
-		l2b_item->lba = (unsigned long)(*metadata_ptr++);
-		l2b_item->ppn = *metadata_ptr++;
+	}
+
+	for(i = 0; i < dev->nr_chunks; i++, pos += chunk_size){
+		if(dev->chunks[i] == NULL) continue;
+
+		off = pos;
+		if(read_from_file(file, page_address(dev->chunks[i]), chunk_size, &off) < 0) goto fail;
+	}
+
+	// 6. Apply the deltas, they may use segments which were free in the full backup
 
-		xa_store(&dev->l2p_map, l2b_item->lba, (void*)l2b_item, GFP_KERNEL);
+delta:
+	if(csl_restore_delta(dev, &epoch, &rebuild) < 0) goto fail;
+	if(rebuild && csl_rebuild_l2p(dev) < 0) goto fail;
+	if(csl_init_segments() < 0){
+		ret = -ENOMEM;
+		goto fail;
 	}
 
+	kfree(buf);
+	dev->journal.epoch = epoch;
+	dev->has_full = true;
 
-	// 3. Read Linked List Data 
-	
-	INIT_LIST_HEAD(&dev->list);
-	for(i = 0; i < gc_entry_num; i++){
-		item = kmalloc(sizeof(struct list_item), GFP_KERNEL);
-		if(IS_ERR(item) || item == NULL){
-			pr_warn();
-			goto nofile;
+	if(dev->lazy_src){
+		/* Every used segment is lazy, the file stays open for them */
+		for(i = 0; i < dev->segment_num; i++){
+			if(dev->segs[i].wp) __set_bit(i, dev->lazy_map);
 		}
-		item->sector = *metadata_ptr++;
-		list_add_tail(&item->list_head, &dev->list);
+		dev->lazy_file[0] = file;
+		dev->lazy_cursor = 0;
+		WRITE_ONCE(dev->lazy_left, bitmap_weight(dev->lazy_map, dev->segment_num));
+		queue_work(system_unbound_wq, &dev->lazy_work);
+	}
+	else {
+		filp_close(file, NULL);
 	}
-	
-	// 4. Read Actual Data
 
-	data_ptr = (u8*)metadata_ptr;
-	memcpy(dev->data, data_ptr, DEVICE_TOTAL_SIZE);
-	
-	vfree(total_data);
 	display_index();
-	pr_info("There are %d XArray Entry, %d GC Entry > total data size is [%d] bytes", xa_entry_num, gc_entry_num, total_data_size);
-	pr_info("CSL : RESTORE COMPLETE");
-	return;
+	pr_info("There are %d L2P Entry, %d GC Entry > total data size is [%lld] bytes", l2p_entry_num, gc_entry_num, pos);
+	pr_info("CSL : RESTORE COMPLETE WITH %u DELTA", dev->nr_deltas);
+	return SUCCESS_EXIT;
+
+fail:
+	pr_warn("CSL : RESTORE ABORTED, THE BACKUP FILES ARE KEPT");
+	kfree(buf);
+	filp_close(file, NULL);
+	csl_lazy_exit(dev);
+	return ret;
 
 nofile:
 	pr_warn(BACKUP_FAIL_MSG);
-	xa_init(&dev->l2p_map);
-	INIT_LIST_HEAD(&dev->list);
-	bitmap_zero(dev->free_map, DEV_SECTOR_NUM);
-	return;
+	kfree(buf);
+	if(file) filp_close(file, NULL);
+	csl_lazy_exit(dev);
+	dev->journal.epoch = 0;
+	dev->has_full = false;
+	memset(dev->l2p, 0xff, dev->lba_num * sizeof(u32)); // CSL_UNMAPPED
+	bitmap_zero(dev->free_map, dev->sector_num);
+	csl_init_segments();
+	return SUCCESS_EXIT;
 }
 
 /*
-* write_to_file() - Write Data
-* @filename : target file name
+* write_to_file() - Write the next part of a file
+* @file : opened file
 * @data : pointer of data array
 * @size : size of data
+* @pos : offset in the file, advanced by size
 */
 
-int write_to_file(const char *filename, const void *data, size_t size) 
+int write_to_file(struct file *file, const void *data, size_t size, loff_t *pos)
 {
-    struct file *file;
-    loff_t pos = 0;
-
-    file = filp_open(filename, O_WRONLY | O_CREAT, 0644);
-    if (IS_ERR(file)) {
-		pr_warn(FILE_OPEN_ERROR_MSG);
-        return FAIL_EXIT;
-    }
-
-    if(kernel_write(file, data, size, &pos) < 0){
+    if(kernel_write(file, data, size, pos) != size){
 		pr_warn(FILE_WRITE_ERROR_MSG);
 		return FAIL_EXIT;
 	}
@@ -165,81 +807,436 @@ int write_to_file(const char *filename, const void *data, size_t size)
     return SUCCESS_EXIT;
 }
 
+
 /*
-* csl_backup() : Make Device Backup File
+* csl_backup_throttle() : keep a backup at its rate limit
+* @ckpt : the backup
+* @bytes : bytes just written
 *
-* Make Backup file for CSL device. 
-* It contains device offset (for page mapping), the entry number and value of XArray and linked list and actual data array.
+* Sleeps until the bytes written so far are due at ckpt->rate_mb, so the page cache is
+* written back little by little instead of competing with requests in bursts.
+* Once the checkpoint thread is asked to stop, the rest goes at full speed.
 */
-void csl_backup(struct csl_dev *dev)
+static void csl_backup_throttle(struct csl_ckpt *ckpt, size_t bytes)
 {
-	unsigned int xa_entry_num=0;
+	unsigned long due;
+
+	ckpt->bytes += bytes;
+	if(!ckpt->rate_mb) return;
+
+	if(kthread_should_stop()){
+		ckpt->rate_mb = 0;
+		return;
+	}
+
+	due = ckpt->start + msecs_to_jiffies(div64_u64(ckpt->bytes * MSEC_PER_SEC, (u64)ckpt->rate_mb << 20));
+	if(time_before(jiffies, due)) schedule_timeout_interruptible(due - jiffies);
+}
+
+/*
+* csl_backup_full() : Make Device Backup File
+* @dev : the device
+* @ckpt : the backup, its mapping is already copied
+*
+* Make Backup file for CSL device in the slot which does not hold the last one.
+* It contains the capacity, the epoch, device offset (for page mapping), the entry number and value of L2P table, actual data array,
+* and the sequence of every segment with the tag of every sector so the mapping can be rebuilt without the L2P entries.
+* Chunks which were never allocated are left as holes of the file, they read as zero.
+* The GC entry number is kept in the header for older versions and is always 0.
+*
+* Everything is written in one pass. The header and the L2P entries come from the copy,
+* the data straight from the device memory. Every segment is pinned, it is neither cleaned nor compressed
+* until it is written, and it is unpinned as soon as its chunks are in the file. Writes land in the page cache and
+* are written back while we go on, the fsync at the end only waits for the tail.
+* The deltas are based on the previous backup, so they are dropped.
+* return : SUCCESS_EXIT, or FAIL_EXIT if the file was not written
+*/
+static int csl_backup_full(struct csl_dev *dev, struct csl_ckpt *ckpt)
+{
+	unsigned int l2p_entry_num=0;
 	unsigned int gc_entry_num=0;
 	unsigned int *metadata_ptr;
+	u32 trailer[2] = { CSL_BACKUP_MAGIC, ckpt->epoch };
 
-	void *data_ptr;
-	struct list_item *litem;
-	struct l2b_item* xa_item;
-
-	u8 *total_data;
-	unsigned int total_data_size = 0;
-
-	// 1. Get the number of XArray entry.
-	void* xa_ret;
-	unsigned long idx;
-	if(!xa_empty(&dev->l2p_map)){
-		xa_for_each(&dev->l2p_map, idx, xa_ret){
-			xa_entry_num++;
-		}
-	}
-	
-	// 2. Get the number of Linked List entry.
-	if(!list_empty(&dev->list)){
-		gc_entry_num = list_count_nodes(&dev->list);
-	}
-	
-	
-	// 3. Make a array for store data and copy header data
-	total_data_size = BACKUP_HEADER_SIZE + (xa_entry_num * XA_ENTRY_SIZE) + (gc_entry_num * GC_ENTRY_SIZE) + DEVICE_TOTAL_SIZE;
-	total_data = vmalloc(total_data_size);
-	
-	if(IS_ERR(total_data) || total_data < 0 || total_data == NULL){
+	unsigned int lba;
+	unsigned int i, seg = 0, end;
+
+	struct file *file, *delta;
+	struct page *chunk;
+	loff_t pos = 0, off;
+	size_t chunk_size = PAGE_SIZE << dev->chunk_order;
+	u32 *buf;
+	int ret = FAIL_EXIT;
+
+	// 1. Get the number of L2P entry.
+	for(lba = 0; lba < dev->lba_num; lba++){
+		if(ckpt->l2p[lba] != CSL_UNMAPPED) l2p_entry_num++;
+	}
+
+	buf = kmalloc(CSL_BACKUP_BUF_SIZE, GFP_KERNEL);
+	if(buf == NULL){
 		pr_info(MALLOC_ERROR_MSG);
-		return;
+		return FAIL_EXIT;
+	}
+
+	file = filp_open(csl_full_path[!dev->full_slot], O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if(IS_ERR(file)){
+		pr_warn(FILE_OPEN_ERROR_MSG);
+		kfree(buf);
+		return FAIL_EXIT;
 	}
-	
-	memcpy(total_data, dev->free_map, FREE_MAP_SIZE);
-	memcpy(total_data + FREE_MAP_SIZE, &xa_entry_num, sizeof(xa_entry_num));
-	memcpy(total_data + FREE_MAP_SIZE + sizeof(xa_entry_num), &gc_entry_num, sizeof(gc_entry_num));
-	
-	// 4. Copy XArray, Linked List value 
-	metadata_ptr = (unsigned int *)(total_data + BACKUP_HEADER_SIZE);
-
-	xa_for_each(&dev->l2p_map, idx, xa_ret){
-		xa_item = (struct l2b_item*)xa_ret;
-		*metadata_ptr++ = (unsigned int)xa_item->lba;;
-		*metadata_ptr++ = xa_item->ppn;
-	}
-	
-	metadata_ptr = (unsigned int*)(total_data + BACKUP_HEADER_SIZE + xa_entry_num * XA_ENTRY_SIZE);
-	
-	list_for_each_entry(litem, &dev->list, list_head){
-		*metadata_ptr++ = litem->sector;
-	}
-	
-	// 5. Copy Actual data array
-	data_ptr = total_data + BACKUP_HEADER_SIZE + (xa_entry_num * XA_ENTRY_SIZE) + (gc_entry_num * GC_ENTRY_SIZE);
-    memcpy(data_ptr, dev->data, DEVICE_TOTAL_SIZE);
-
-	if (write_to_file(BACKUP_FILE_PATH, total_data, total_data_size) < 0) {
-        pr_warn(FILE_WRITE_ERROR_MSG);
-		return;
-    }
 
-	vfree(total_data);
+	// 2. Write header data
+	if(write_to_file(file, &dev->sector_num, sizeof(dev->sector_num), &pos) < 0) goto out;
+	if(write_to_file(file, &ckpt->epoch, sizeof(ckpt->epoch), &pos) < 0) goto out;
+	if(write_to_file(file, ckpt->free_map, FREE_MAP_SIZE(dev->sector_num), &pos) < 0) goto out;
+	if(write_to_file(file, &l2p_entry_num, sizeof(l2p_entry_num), &pos) < 0) goto out;
+	if(write_to_file(file, &gc_entry_num, sizeof(gc_entry_num), &pos) < 0) goto out;
+
+	// 3. Write L2P value a buffer at a time
+	metadata_ptr = buf;
+
+	for(lba = 0; lba < dev->lba_num; lba++){
+		if(ckpt->l2p[lba] == CSL_UNMAPPED) continue;
+		*metadata_ptr++ = lba;
+		*metadata_ptr++ = ckpt->l2p[lba];
+
+		if((void *)metadata_ptr - (void *)buf == CSL_BACKUP_BUF_SIZE){
+			if(write_to_file(file, buf, CSL_BACKUP_BUF_SIZE, &pos) < 0) goto out;
+			csl_backup_throttle(ckpt, CSL_BACKUP_BUF_SIZE);
+			metadata_ptr = buf;
+		}
+	}
+	if(metadata_ptr != buf && write_to_file(file, buf, (void *)metadata_ptr - (void *)buf, &pos) < 0) goto out;
+
+	// 4. Write Actual data straight from the chunks
+	for(i = 0; i < dev->nr_chunks; i++, pos += chunk_size){
+		/* A chunk allocated after the copy only holds segments which were free in it, pinned all the same */
+		chunk = READ_ONCE(dev->chunks[i]);
+		if(chunk){
+			off = pos;
+			if(write_to_file(file, page_address(chunk), chunk_size, &off) < 0) goto out;
+			csl_backup_throttle(ckpt, chunk_size);
+		}
+		else if(dev->zpages && rcu_access_pointer(dev->zpages[i])){
+			/* Compressed before the copy, it goes out through the L2P buffer */
+			csl_copy_out(i << dev->chunk_shift, buf, PAGE_SECTORS);
+			off = pos;
+			if(write_to_file(file, buf, chunk_size, &off) < 0) goto out;
+			csl_backup_throttle(ckpt, chunk_size);
+		}
+
+		/* Segments which are in the file can be cleaned again */
+		end = ((i + 1) << dev->chunk_shift) / CSL_SEGMENT_SECTORS;
+		for(; seg < end; seg++) clear_bit(seg, dev->ckpt_pin);
+	}
+
+	// 5. Write the sequence of the segments and the tags of the sectors, a shard at a time
+	if(write_to_file(file, ckpt->seq, dev->segment_num * sizeof(u64), &pos) < 0) goto out;
+
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		if(write_to_file(file, ckpt->p2l + i * dev->shard_sector_num, dev->shard_sector_num * sizeof(u32), &pos) < 0) goto out;
+		csl_backup_throttle(ckpt, dev->shard_sector_num * sizeof(u32));
+	}
+
+	// 6. Trailer, only after the rest is durable. It also covers the holes of the last chunks
+	if(vfs_fsync(file, 0) < 0) goto out;
+	if(write_to_file(file, trailer, sizeof(trailer), &pos) < 0) goto out;
+	if(vfs_fsync(file, 0) < 0) goto out;
+
+	ret = SUCCESS_EXIT;
+	dev->full_slot = !dev->full_slot;
+	dev->has_full = true;
+	dev->nr_deltas = 0;
+	dev->delta_pos = 0;
+
+	/* Stale deltas never match the next epoch, this only gives back the space */
+	delta = filp_open(DELTA_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(!IS_ERR(delta)) filp_close(delta, NULL);
 
-	display_index();
-	
 	pr_info("CSL : BACKUP COMPLETE");
-	pr_info("There are %d XArray Entry, %d GC Entry > total data size is [%d] bytes", xa_entry_num, gc_entry_num, total_data_size);
+	pr_info("There are %d L2P Entry, %d GC Entry > total data size is [%lld] bytes", l2p_entry_num, gc_entry_num, pos);
+
+out:
+	if(ret < 0) pr_warn(BACKUP_FAIL_MSG);
+	filp_close(file, NULL);
+	kfree(buf);
+	return ret;
+}
+
+/*
+* csl_backup_seg_oob() : write the record of a segment in a delta, without its data
+* @file : the delta file
+* @ckpt : the backup
+* @seg : the segment index
+* @idx : the index written, with CSL_DELTA_NO_DATA if no data follows
+* @pos : offset in the file, advanced past the record
+*/
+static int csl_backup_seg_oob(struct file *file, struct csl_ckpt *ckpt, u32 seg, u32 idx, loff_t *pos)
+{
+	if(write_to_file(file, &idx, sizeof(idx), pos) < 0) return FAIL_EXIT;
+	if(write_to_file(file, ckpt->free_map + BIT_WORD(seg * CSL_SEGMENT_SECTORS), CSL_SEG_MAP_SIZE, pos) < 0) return FAIL_EXIT;
+	if(write_to_file(file, &ckpt->seq[seg], sizeof(u64), pos) < 0) return FAIL_EXIT;
+	if(write_to_file(file, ckpt->p2l + seg * CSL_SEGMENT_SECTORS, CSL_OOB_TAG_SIZE, pos) < 0) return FAIL_EXIT;
+
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_backup_delta() : append the changes since the last backup to the delta file
+* @dev : the device
+* @ckpt : the backup, the dirty blocks and segments are already copied
+*
+* Only dirty L2P blocks and dirty segments are written. A segment carries its free_map words,
+* its sequence and its tags, and its data if it is used and the data changed.
+* A segment is unpinned as soon as its data is in the file.
+* The trailer goes in after the body is on stable storage, so a delta is complete or ignored.
+* return : SUCCESS_EXIT, or FAIL_EXIT if the delta was not written
+*/
+static int csl_backup_delta(struct csl_dev *dev, struct csl_ckpt *ckpt)
+{
+	struct csl_delta_hdr hdr = {
+		.magic = CSL_DELTA_MAGIC,
+		.epoch = ckpt->epoch,
+	};
+	u32 trailer[2] = { CSL_DELTA_MAGIC, ckpt->epoch };
+	unsigned int nr_l2p_blocks = dev->lba_num / CSL_L2P_BLOCK;
+	unsigned long *words;
+	struct file *file;
+	loff_t pos = dev->delta_pos;
+	u32 idx;
+	int ret = FAIL_EXIT;
+
+	// 1. Size of the delta
+	hdr.length = sizeof(hdr) + sizeof(trailer);
+
+	for_each_set_bit(idx, ckpt->dirty_l2p, nr_l2p_blocks){
+		hdr.nr_blocks++;
+		hdr.length += sizeof(idx) + CSL_L2P_BLOCK * sizeof(u32);
+	}
+
+	for_each_set_bit(idx, ckpt->dirty_segs, dev->segment_num){
+		hdr.nr_segs++;
+		hdr.length += sizeof(idx) + CSL_SEG_MAP_SIZE + sizeof(u64) + CSL_OOB_TAG_SIZE;
+
+		words = ckpt->free_map + BIT_WORD(idx * CSL_SEGMENT_SECTORS);
+		if(!bitmap_empty(words, CSL_SEGMENT_SECTORS)) hdr.length += CSL_SEGMENT_SECTORS * SECTOR_SIZE;
+	}
+
+	for_each_set_bit(idx, ckpt->dirty_oob, dev->segment_num){
+		hdr.nr_segs++;
+		hdr.length += sizeof(idx) + CSL_SEG_MAP_SIZE + sizeof(u64) + CSL_OOB_TAG_SIZE;
+	}
+
+	file = filp_open(DELTA_FILE_PATH, O_WRONLY | O_CREAT | O_LARGEFILE, 0644);
+	if(IS_ERR(file)){
+		pr_warn(FILE_OPEN_ERROR_MSG);
+		return FAIL_EXIT;
+	}
+
+	// 2. Header, L2P blocks and segments
+	if(write_to_file(file, &hdr, sizeof(hdr), &pos) < 0) goto out;
+
+	for_each_set_bit(idx, ckpt->dirty_l2p, nr_l2p_blocks){
+		if(write_to_file(file, &idx, sizeof(idx), &pos) < 0) goto out;
+		if(write_to_file(file, ckpt->l2p + idx * CSL_L2P_BLOCK, CSL_L2P_BLOCK * sizeof(u32), &pos) < 0) goto out;
+		csl_backup_throttle(ckpt, sizeof(idx) + CSL_L2P_BLOCK * sizeof(u32));
+	}
+
+	for_each_set_bit(idx, ckpt->dirty_segs, dev->segment_num){
+		if(csl_backup_seg_oob(file, ckpt, idx, idx, &pos) < 0) goto out;
+
+		words = ckpt->free_map + BIT_WORD(idx * CSL_SEGMENT_SECTORS);
+		if(!bitmap_empty(words, CSL_SEGMENT_SECTORS)){
+			if(csl_seg_io(file, idx, &pos, 1) < 0) goto out;
+			clear_bit(idx, dev->ckpt_pin);
+			csl_backup_throttle(ckpt, CSL_SEGMENT_SECTORS * SECTOR_SIZE);
+		}
+	}
+
+	for_each_set_bit(idx, ckpt->dirty_oob, dev->segment_num){
+		if(csl_backup_seg_oob(file, ckpt, idx, idx | CSL_DELTA_NO_DATA, &pos) < 0) goto out;
+	}
+
+	// 3. Trailer, only after the body is durable
+	if(vfs_fsync(file, 0) < 0) goto out;
+	if(write_to_file(file, trailer, sizeof(trailer), &pos) < 0) goto out;
+	if(vfs_fsync(file, 0) < 0) goto out;
+
+	ret = SUCCESS_EXIT;
+	dev->delta_pos = pos;
+	dev->nr_deltas++;
+
+	pr_info("CSL : DELTA BACKUP COMPLETE, %u L2P BLOCK, %u SEGMENT, [%llu] bytes", hdr.nr_blocks, hdr.nr_segs, hdr.length);
+
+out:
+	if(ret < 0) pr_warn(BACKUP_FAIL_MSG);
+	filp_close(file, NULL);
+	return ret;
+}
+
+/*
+* csl_backup_free() : free a backup
+* @ckpt : the backup, members which were not allocated are NULL
+*/
+static void csl_backup_free(struct csl_ckpt *ckpt)
+{
+	kvfree(ckpt->l2p);
+	bitmap_free(ckpt->free_map);
+	kvfree(ckpt->p2l);
+	kvfree(ckpt->seq);
+	bitmap_free(ckpt->dirty_l2p);
+	bitmap_free(ckpt->dirty_segs);
+	bitmap_free(ckpt->dirty_oob);
+	kfree(ckpt);
+}
+
+/*
+* csl_backup_dirty() : check there is something to back up
+* @dev : the device
+*
+* return : true if there is no full backup yet or something changed since the last backup
+*/
+bool csl_backup_dirty(struct csl_dev *dev)
+{
+	return !dev->has_full || !bitmap_empty(dev->dirty_segs, dev->segment_num)
+		|| !bitmap_empty(dev->dirty_l2p, dev->lba_num / CSL_L2P_BLOCK);
+}
+
+/*
+* csl_seg_pinned() : check a checkpoint still has to write a segment
+* @seg : the segment index
+*/
+bool csl_seg_pinned(unsigned int seg)
+{
+	return test_bit(seg, dev->ckpt_pin);
+}
+
+/*
+* csl_backup_begin() : get ready for a backup
+* @dev : the device
+* @rate_mb : write rate limit of the backup in MB per second, 0 for none
+*
+* Lazy segments are loaded first, since the backup files are about to be rewritten.
+* A delta if there is a full backup to build on and it has less than backup_merge deltas,
+* a full backup otherwise. The copy of the mapping is allocated here, so the snapshot does not sleep.
+* return : the backup, or NULL if it can not be taken
+*/
+struct csl_ckpt *csl_backup_begin(struct csl_dev *dev, unsigned int rate_mb)
+{
+	struct csl_ckpt *ckpt;
+
+	if(csl_lazy_load_all() < 0) return NULL;
+
+	ckpt = kzalloc(sizeof(struct csl_ckpt), GFP_KERNEL);
+	if(ckpt == NULL){
+		pr_warn(MALLOC_ERROR_MSG);
+		return NULL;
+	}
+
+	ckpt->full = !dev->has_full || dev->nr_deltas >= backup_merge;
+	ckpt->rate_mb = rate_mb;
+
+	ckpt->l2p = kvmalloc_array(dev->lba_num, sizeof(u32), GFP_KERNEL);
+	ckpt->free_map = bitmap_zalloc(dev->sector_num, GFP_KERNEL);
+	ckpt->p2l = kvmalloc_array(dev->sector_num, sizeof(u32), GFP_KERNEL);
+	ckpt->seq = kvmalloc_array(dev->segment_num, sizeof(u64), GFP_KERNEL);
+	ckpt->dirty_l2p = bitmap_zalloc(dev->lba_num / CSL_L2P_BLOCK, GFP_KERNEL);
+	ckpt->dirty_segs = bitmap_zalloc(dev->segment_num, GFP_KERNEL);
+	ckpt->dirty_oob = bitmap_zalloc(dev->segment_num, GFP_KERNEL);
+
+	if(!ckpt->l2p || !ckpt->free_map || !ckpt->p2l || !ckpt->seq || !ckpt->dirty_l2p || !ckpt->dirty_segs || !ckpt->dirty_oob){
+		pr_warn(MALLOC_ERROR_MSG);
+		csl_backup_free(ckpt);
+		return NULL;
+	}
+
+	return ckpt;
+}
+
+/*
+* csl_backup_snapshot() : copy the mapping to back up
+* @dev : the device
+* @ckpt : the backup
+*
+* One shard at a time under its lock, so a request waits for the copy of one shard at most.
+* Shards do not share LBAs or segments, the copy of each one is consistent, and a change after it
+* reaches the next backup through the journal of the next epoch.
+* The dirty bits of a shard are taken with its copy, and the used segments whose data is written
+* are pinned until it is, so GC never hands out a sector the backup still points to.
+* A full backup pins every segment, so the compressor does not free a chunk it is writing.
+* Caller holds journal->mutex, so no commit runs until the journal is switched to the next epoch.
+*/
+void csl_backup_snapshot(struct csl_dev *dev, struct csl_ckpt *ckpt)
+{
+	unsigned int nr_blocks = dev->lba_num / CSL_L2P_BLOCK;
+	unsigned int block, seg, first;
+	struct csl_shard *shard;
+	int i;
+
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		shard = &dev->shards[i];
+		first = shard->base / CSL_SEGMENT_SECTORS;
+
+		spin_lock(&shard->lock);
+
+		/* A block of the mapping is one stripe, the stripes of the shard are every CSL_NR_SHARDS */
+		for(block = i; block < nr_blocks; block += CSL_NR_SHARDS){
+			if(test_and_clear_bit(block, dev->dirty_l2p)) __set_bit(block, ckpt->dirty_l2p);
+			else if(!ckpt->full) continue;
+
+			memcpy(ckpt->l2p + block * CSL_L2P_BLOCK, dev->l2p + block * CSL_L2P_BLOCK, CSL_L2P_BLOCK * sizeof(u32));
+		}
+
+		/* A segment whose data changed carries its tags, so it is not a tag only segment as well */
+		for(seg = first; seg < first + dev->shard_segment_num; seg++){
+			if(test_and_clear_bit(seg, dev->dirty_segs)){
+				__set_bit(seg, ckpt->dirty_segs);
+				clear_bit(seg, dev->dirty_oob);
+			}
+			else if(test_and_clear_bit(seg, dev->dirty_oob)) __set_bit(seg, ckpt->dirty_oob);
+			else if(!ckpt->full) continue;
+
+			bitmap_copy(ckpt->free_map + BIT_WORD(seg * CSL_SEGMENT_SECTORS), dev->free_map + BIT_WORD(seg * CSL_SEGMENT_SECTORS), CSL_SEGMENT_SECTORS);
+			memcpy(ckpt->p2l + seg * CSL_SEGMENT_SECTORS, dev->p2l + seg * CSL_SEGMENT_SECTORS, CSL_OOB_TAG_SIZE);
+			ckpt->seq[seg] = dev->segs[seg].seq;
+
+			/* A full backup reads every chunk, also of segments which are opened after the copy */
+			if(ckpt->full || (dev->segs[seg].wp && !test_bit(seg, ckpt->dirty_oob))) set_bit(seg, dev->ckpt_pin);
+		}
+
+		spin_unlock(&shard->lock);
+		cond_resched();
+	}
+}
+
+/*
+* csl_backup_write() : write a backup from its snapshot
+* @dev : the device
+* @ckpt : the backup, freed here
+*
+* Requests and GC go on meanwhile. Every segment is unpinned at the end,
+* and if the backup failed the dirty bits go back to the device for the next one.
+* return : SUCCESS_EXIT, or FAIL_EXIT if the backup is not complete
+*/
+int csl_backup_write(struct csl_dev *dev, struct csl_ckpt *ckpt)
+{
+	u32 idx;
+	int ret;
+
+	ckpt->start = jiffies;
+
+	if(ckpt->full) ret = csl_backup_full(dev, ckpt);
+	else ret = csl_backup_delta(dev, ckpt);
+
+	bitmap_zero(dev->ckpt_pin, dev->segment_num);
+
+	if(ret < 0){
+		for_each_set_bit(idx, ckpt->dirty_l2p, dev->lba_num / CSL_L2P_BLOCK) set_bit(idx, dev->dirty_l2p);
+		for_each_set_bit(idx, ckpt->dirty_segs, dev->segment_num) set_bit(idx, dev->dirty_segs);
+		for_each_set_bit(idx, ckpt->dirty_oob, dev->segment_num) set_bit(idx, dev->dirty_oob);
+	}
+
+	csl_backup_free(ckpt);
+	return ret;
 }
@@ -0,0 +1,321 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/moduleparam.h>
+#include <linux/crypto.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+
+#include "csl.h"
+
+static char *compress = "";
+module_param(compress, charp, 0444);
+MODULE_PARM_DESC(compress, "compress closed segments with this crypto algorithm (lz4, zstd, lzo...), empty for none");
+
+/*
+* csl_compress_init() : set compression up if the compress parameter names an algorithm
+* @dev : the device, its chunks are allocated
+*
+* Pages are compressed one by one, so it needs 4KB chunks and is left off with huge_backing.
+* return : SUCCESS_EXIT, also if compression stays off, FAIL_EXIT if memory is short
+*/
+int csl_compress_init(struct csl_dev *dev)
+{
+	struct csl_zstrm *zs;
+	int cpu;
+
+	INIT_DELAYED_WORK(&dev->cz_work, csl_compress_work);
+
+	if(compress == NULL || compress[0] == '\0') return SUCCESS_EXIT;
+
+	if(dev->chunk_order != 0){
+		pr_warn("CSL : compression needs 4KB pages, it is off with huge_backing");
+		return SUCCESS_EXIT;
+	}
+
+	if(!crypto_has_comp(compress, 0, 0)){
+		pr_warn("CSL : no compression algorithm %s, compression is off", compress);
+		return SUCCESS_EXIT;
+	}
+
+	dev->zpages = kvcalloc(dev->nr_chunks, sizeof(struct csl_zpage *), GFP_KERNEL);
+	dev->cz_todo = bitmap_zalloc(dev->segment_num, GFP_KERNEL);
+	dev->cz_buf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL); // room for data which grows
+	dev->zstrm = alloc_percpu(struct csl_zstrm);
+	if(!dev->zpages || !dev->cz_todo || !dev->cz_buf || !dev->zstrm) goto fail;
+
+	dev->cz_tfm = crypto_alloc_comp(compress, 0, 0);
+	if(IS_ERR(dev->cz_tfm)){
+		dev->cz_tfm = NULL;
+		goto fail;
+	}
+
+	/* Reads decompress on the CPU they run on, each one has its own context */
+	for_each_possible_cpu(cpu){
+		zs = per_cpu_ptr(dev->zstrm, cpu);
+
+		zs->tfm = crypto_alloc_comp(compress, 0, 0);
+		if(IS_ERR(zs->tfm)){
+			zs->tfm = NULL;
+			goto fail;
+		}
+
+		zs->buf = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+		if(!zs->buf) goto fail;
+	}
+
+	pr_info("CSL : COMPRESS CLOSED SEGMENTS WITH %s", compress);
+	return SUCCESS_EXIT;
+
+fail:
+	pr_warn(MALLOC_ERROR_MSG);
+	csl_compress_exit(dev);
+	return FAIL_EXIT;
+}
+
+/*
+* csl_compress_exit() : stop compressing and free the compressed pages
+* @dev : the device, no request runs anymore
+*/
+void csl_compress_exit(struct csl_dev *dev)
+{
+	struct csl_zstrm *zs;
+	unsigned int i;
+	int cpu;
+
+	if(dev->zpages){
+		cancel_delayed_work_sync(&dev->cz_work);
+		for(i = 0; i < dev->nr_chunks; i++) kfree(rcu_dereference_protected(dev->zpages[i], 1));
+	}
+	kvfree(dev->zpages);
+	dev->zpages = NULL;
+
+	if(dev->zstrm){
+		for_each_possible_cpu(cpu){
+			zs = per_cpu_ptr(dev->zstrm, cpu);
+			if(zs->tfm) crypto_free_comp(zs->tfm);
+			kfree(zs->buf);
+		}
+		free_percpu(dev->zstrm);
+		dev->zstrm = NULL;
+	}
+
+	if(dev->cz_tfm) crypto_free_comp(dev->cz_tfm);
+	dev->cz_tfm = NULL;
+	kfree(dev->cz_buf);
+	dev->cz_buf = NULL;
+	bitmap_free(dev->cz_todo);
+	dev->cz_todo = NULL;
+}
+
+/*
+* csl_compress_mark() : queue a segment which was just closed for compression
+* @seg : the segment index
+*
+* Called under the shard lock.
+*/
+void csl_compress_mark(unsigned int seg)
+{
+	if(dev->zpages == NULL) return;
+
+	set_bit(seg, dev->cz_todo);
+	queue_delayed_work(system_unbound_wq, &dev->cz_work, 0);
+}
+
+/*
+* csl_compress_all() : queue every closed segment, after the backup and the journal are restored
+*/
+void csl_compress_all(void)
+{
+	struct csl_shard *shard;
+	unsigned int seg;
+
+	if(dev->zpages == NULL) return;
+
+	for(seg = 0; seg < dev->segment_num; seg++){
+		shard = &dev->shards[csl_ppn_to_shard(seg * CSL_SEGMENT_SECTORS)];
+
+		spin_lock(&shard->lock);
+		if(dev->segs[seg].wp && &dev->segs[seg] != shard->open) set_bit(seg, dev->cz_todo);
+		spin_unlock(&shard->lock);
+	}
+
+	queue_delayed_work(system_unbound_wq, &dev->cz_work, 0);
+}
+
+/*
+* csl_compress_release() : drop the compressed pages of a segment GC gave back
+* @seg : the segment index
+*
+* Called under the shard lock. Its chunks are allocated again when it is opened.
+*/
+void csl_compress_release(unsigned int seg)
+{
+	unsigned int pg = seg * CSL_SEGMENT_SECTORS >> dev->chunk_shift;
+	unsigned int end = pg + (CSL_SEGMENT_SECTORS >> dev->chunk_shift);
+	struct csl_zpage *z;
+
+	if(dev->zpages == NULL) return;
+
+	clear_bit(seg, dev->cz_todo);
+
+	for(; pg < end; pg++){
+		z = rcu_dereference_protected(dev->zpages[pg], 1);
+		if(z == NULL) continue;
+
+		RCU_INIT_POINTER(dev->zpages[pg], NULL);
+		kfree_rcu(z, rcu);
+	}
+}
+
+/*
+* csl_zpage_get() : decompress a page for a read
+* @pg : the chunk index of the page, its chunk is NULL
+*
+* The caller holds rcu_read_lock() and calls csl_zpage_put() once it copied the data,
+* the buffer belongs to this CPU until then.
+* return : the page in the buffer of this CPU, NULL if it is not compressed either
+*/
+void *csl_zpage_get(unsigned int pg)
+{
+	struct csl_zstrm *zs;
+	struct csl_zpage *z;
+	unsigned int len = PAGE_SIZE;
+
+	preempt_disable();
+	if(dev->zpages == NULL) return NULL;
+
+	z = rcu_dereference(dev->zpages[pg]);
+	if(z == NULL) return NULL;
+
+	zs = this_cpu_ptr(dev->zstrm);
+	if(crypto_comp_decompress(zs->tfm, z->data, z->len, zs->buf, &len) < 0 || len != PAGE_SIZE){
+		pr_warn_ratelimited("CSL : PAGE %u DOES NOT DECOMPRESS", pg);
+		return NULL;
+	}
+
+	return zs->buf;
+}
+
+void csl_zpage_put(void)
+{
+	preempt_enable();
+}
+
+/*
+* csl_compress_seg() : compress the pages of a closed segment
+* @seg : the segment index
+*
+* The data of a closed segment does not change until GC gives it back, so it is compressed
+* without the shard lock. The pages are switched under the lock only if the segment
+* was not given back, backed up or opened again meanwhile, and the raw pages are freed
+* after a grace period so reads which still look at them are done.
+* return : SUCCESS_EXIT, or FAIL_EXIT if the segment must be tried again later
+*/
+static int csl_compress_seg(unsigned int seg)
+{
+	struct csl_shard *shard = &dev->shards[csl_ppn_to_shard(seg * CSL_SEGMENT_SECTORS)];
+	struct csl_segment *s = &dev->segs[seg];
+	unsigned int first = seg * CSL_SEGMENT_SECTORS >> dev->chunk_shift;
+	unsigned int nr = CSL_SEGMENT_SECTORS >> dev->chunk_shift;
+	struct csl_zpage *z[CSL_SEGMENT_SECTORS >> PAGE_SECTORS_SHIFT] = { NULL };
+	struct page *raw[CSL_SEGMENT_SECTORS >> PAGE_SECTORS_SHIFT] = { NULL };
+	unsigned int i, len;
+	unsigned int pages = 0, kept = 0;
+	u64 seq, t, bytes = 0;
+	int ret = SUCCESS_EXIT;
+
+	spin_lock(&shard->lock);
+	seq = s->seq;
+	if(s->wp == 0 || s == shard->open){
+		spin_unlock(&shard->lock);
+		return SUCCESS_EXIT;
+	}
+	if(csl_seg_pinned(seg) || csl_seg_lazy(seg)){
+		spin_unlock(&shard->lock);
+		return FAIL_EXIT;
+	}
+	spin_unlock(&shard->lock);
+
+	t = ktime_get_ns();
+
+	for(i = 0; i < nr; i++){
+		raw[i] = READ_ONCE(dev->chunks[first + i]);
+		if(raw[i] == NULL) continue;
+
+		len = 2 * PAGE_SIZE;
+		pages++;
+
+		/* Data which does not shrink enough stays raw */
+		if(crypto_comp_compress(dev->cz_tfm, page_address(raw[i]), PAGE_SIZE, dev->cz_buf, &len) < 0 || len > CSL_CZ_MAX_LEN){
+			kept++;
+			bytes += PAGE_SIZE;
+			raw[i] = NULL;
+			continue;
+		}
+
+		z[i] = kmalloc(struct_size(z[i], data, len), GFP_KERNEL | __GFP_NOWARN);
+		if(z[i] == NULL){
+			raw[i] = NULL;
+			ret = FAIL_EXIT;
+			continue;
+		}
+
+		z[i]->len = len;
+		memcpy(z[i]->data, dev->cz_buf, len);
+		bytes += len;
+	}
+
+	csl_stat_add(CSL_STAT_CZ_NS, ktime_get_ns() - t);
+
+	spin_lock(&shard->lock);
+	if(s->seq != seq || s->wp == 0 || s == shard->open || csl_seg_pinned(seg)){
+		spin_unlock(&shard->lock);
+		for(i = 0; i < nr; i++) kfree(z[i]);
+		return FAIL_EXIT;
+	}
+
+	/* A read which finds the chunk gone finds the compressed page */
+	for(i = 0; i < nr; i++){
+		if(z[i] == NULL) continue;
+
+		rcu_assign_pointer(dev->zpages[first + i], z[i]);
+		smp_store_release(&dev->chunks[first + i], NULL);
+	}
+	spin_unlock(&shard->lock);
+
+	csl_stat_add(CSL_STAT_CZ_PAGES, pages);
+	csl_stat_add(CSL_STAT_CZ_RAW, kept);
+	csl_stat_add(CSL_STAT_CZ_BYTES, bytes);
+
+	synchronize_rcu();
+	for(i = 0; i < nr; i++){
+		if(raw[i]) __free_page(raw[i]);
+	}
+
+	return ret;
+}
+
+/*
+* csl_compress_work() : compress the segments closed since the last pass
+* @work : dev->cz_work
+*
+* Segments which can not be compressed yet stay queued, and the pass runs again after CSL_CZ_RETRY.
+*/
+void csl_compress_work(struct work_struct *work)
+{
+	unsigned int seg;
+	bool retry = false;
+
+	for_each_set_bit(seg, dev->cz_todo, dev->segment_num){
+		clear_bit(seg, dev->cz_todo);
+
+		if(csl_compress_seg(seg) < 0){
+			set_bit(seg, dev->cz_todo);
+			retry = true;
+		}
+		cond_resched();
+	}
+
+	if(retry) queue_delayed_work(system_unbound_wq, &dev->cz_work, CSL_CZ_RETRY);
+}
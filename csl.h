@@ -1,24 +1,120 @@
 
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/blk-mq.h>
-#include <linux/xarray.h>
 #include <linux/list.h>
 #include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/crypto.h>
 
 MODULE_AUTHOR("MinyoungKim");
 MODULE_DESCRIPTION("Virtual Block Device Driver");
 MODULE_LICENSE("GPL");
 
 #define DEV_NAME "CSL"
-#define DEVICE_TOTAL_SIZE 16*1024*1024 // 16MB
 #define QUEUE_LIMIT 128
+#define CSL_MAX_HW_SECTORS 2048 // 1MB request
+#define CSL_MAX_DISCARD_SECTORS (64 * 1024 * 1024 / SIZE_OF_SECTOR) // 64MB, the block layer splits larger trims
+#define CSL_REQUEUE_DELAY 3 // ms before a batch retries requests which ran out of memory
 #define DEV_FIRST_MINOR 0
 #define DEV_MINORS 16
 
 #define SIZE_OF_SECTOR 512
-#define DEV_SECTOR_NUM DEVICE_TOTAL_SIZE/SIZE_OF_SECTOR
-#define BACKUP_FILE_PATH "/dev/csl_backup"
-#define FREE_MAP_SIZE BITS_TO_LONGS(DEV_SECTOR_NUM) * sizeof(unsigned long)
+#define BACKUP_FILE_PATH "/dev/csl_backup" // slot 0, slot 1 has ".1" appended
+#define FREE_MAP_SIZE(nr_sector) (BITS_TO_LONGS(nr_sector) * sizeof(unsigned long))
+
+/*
+* CAPACITY CONSTANT
+*
+* The capacity is the capacity_mb module parameter. Every MB gives one segment to each shard,
+* so the geometry in struct csl_dev divides evenly. The upper bound keeps PPNs in 32 bits.
+*/
+#define CSL_DEFAULT_CAPACITY_MB 16
+#define CSL_MIN_CAPACITY_MB 4
+#define CSL_MAX_CAPACITY_MB (1024 * 1024) // 1TB
+
+/*
+* BACKING CONSTANT
+*
+* Data is kept in chunks of 2^chunk_order pages. Order 0 chunks are allocated per segment on first use.
+* With huge_backing, 2MB chunks are allocated when the module is loaded, so a whole chunk
+* is one PMD of the direct map and the chunk table is 512 times smaller.
+*/
+#define CSL_HUGE_ORDER (21 - PAGE_SHIFT) // 2MB
+
+/*
+* COMPRESSION CONSTANT
+*
+* With the compress parameter, the pages of closed segments are compressed in the background
+* with the crypto API and kept in slots of their compressed size, so memory per MB of capacity shrinks.
+* Segments being written, backed up or lazily restored stay raw. A page which does not shrink
+* below CSL_CZ_MAX_LEN is kept raw, it would not pay for its decompression.
+*/
+#define CSL_CZ_MAX_LEN (PAGE_SIZE * 3 / 4)
+#define CSL_CZ_RETRY HZ // a pass which skipped segments runs again after this
+
+/*
+* DEDUP CONSTANT
+*
+* With the dedup parameter, every sector written is hashed and looked up in a direct-mapped index
+* of its shard. LBAs with the same data share one physical sector, which counts its references
+* and keeps its LBAs in a chain linked both ways through dev->dd_next and dev->dd_prev.
+* A reference count saturates at U16_MAX, later copies of the data get a sector of their own.
+*/
+
+/*
+* FTL SHARD CONSTANT
+*
+* LBAs are striped over CSL_NR_SHARDS shards by CSL_SHARD_STRIPE sectors.
+* Each shard owns its own lock, GC list, the L2P entries of its LBAs and a contiguous slice of the physical sectors,
+* so requests that hit different shards never share a lock.
+*/
+#define CSL_NR_SHARDS 16
+#define CSL_SHARD_STRIPE 128 // 64KB
+
+/* A read which raced a remap this many times copies once more under the shard lock */
+#define CSL_READ_RETRIES 4
+
+/*
+* SEGMENT CONSTANT
+*
+* Physical sectors are written append-only, one segment at a time.
+* Memory of a segment is allocated when it is opened for the first time.
+*/
+#define CSL_SEGMENT_SECTORS 128 // 64KB
+
+/* A write piece is at most one stripe, so it is split over two segments at most */
+static_assert(CSL_SHARD_STRIPE <= CSL_SEGMENT_SECTORS);
+
+/* How many of n sectors an allocation at ppn got, it stops at the end of the segment */
+#define csl_alloc_len(ppn, n) min_t(unsigned int, (n), CSL_SEGMENT_SECTORS - (ppn) % CSL_SEGMENT_SECTORS)
+static_assert(CSL_SEGMENT_SECTORS % PAGE_SECTORS == 0);
+
+/*
+* GARBAGE COLLECTION CONSTANT
+*
+* CSL_OP_PERCENT of every shard, at least CSL_OP_SEGMENTS segments, is not exposed as logical capacity,
+* so GC always finds invalid sectors to reclaim. Host writes never take the last
+* CSL_GC_RESERVE free segments, those are left for migrating valid sectors.
+*/
+#define CSL_OP_PERCENT 7
+#define CSL_OP_SEGMENTS 2
+#define CSL_GC_RESERVE 1
+
+#define CSL_GC_GREEDY 0
+#define CSL_GC_COST_BENEFIT 1
+
+/*
+* Background GC wakes up when a shard has less than CSL_GC_LOW_WM free segments
+* and cleans until it has CSL_GC_HIGH_WM. It drops the shard lock every CSL_GC_STEP sectors.
+*/
+#define CSL_GC_LOW_WM 2
+#define CSL_GC_HIGH_WM 3
+#define CSL_GC_STEP 32
 
 
 /**
@@ -26,15 +122,95 @@ MODULE_LICENSE("GPL");
  */
 #define SUCCESS_EXIT 0
 #define FAIL_EXIT -1
-#define OUT_OF_SECTOR DEV_SECTOR_NUM + 10
+
+/* Errors of find_free_sector() and csl_write(), above every PPN and apart from the L2P sentinels */
+#define OUT_OF_SECTOR (U32_MAX - 16)
+#define OUT_OF_MEMORY (U32_MAX - 17)
+
+/* L2P entry of a logical block which was never written */
+#define CSL_UNMAPPED U32_MAX
+
+/* L2P entry of a logical block last written with zeroes, it has no physical sector and reads as zeroes */
+#define CSL_ZERO (U32_MAX - 1)
+
+/* The L2P entry points at a physical sector */
+#define csl_l2p_mapped(ppn) ((ppn) < dev->sector_num)
+
+static_assert((u64)CSL_MAX_CAPACITY_MB * 1024 * 1024 / SIZE_OF_SECTOR <= OUT_OF_MEMORY);
+static_assert(OUT_OF_SECTOR < CSL_ZERO && OUT_OF_MEMORY < CSL_ZERO);
 
 /*
 * DEVICE BACKUP CONSTANT
 */
-#define BACKUP_HEADER_SIZE 2 * sizeof(unsigned int) + FREE_MAP_SIZE
-#define XA_ENTRY_SIZE 2 * sizeof(unsigned int)
+#define BACKUP_HEADER_SIZE(nr_sector) (4 * sizeof(unsigned int) + FREE_MAP_SIZE(nr_sector))
+#define CSL_BACKUP_BUF_SIZE (64 * 1024) // L2P entries are packed through this buffer
+
+/*
+* A full backup goes to the slot which does not hold the last one, and ends with a trailer
+* of magic and epoch once the rest is on stable storage. Restore takes the newest slot with a trailer.
+*/
+#define CSL_BACKUP_MAGIC 0x43534c42 // "CSLB"
+
+/*
+* INCREMENTAL BACKUP CONSTANT
+*
+* A backup after the full one only appends a delta of the segments and L2P blocks changed
+* since the previous backup. Every backup_merge deltas, a full one is taken and the deltas are dropped.
+*/
+#define DELTA_FILE_PATH "/dev/csl_backup_delta"
+#define CSL_DELTA_MAGIC 0x43534c64 // "CSLd"
+#define CSL_L2P_BLOCK CSL_SHARD_STRIPE // L2P entries in a block of the mapping delta, a block belongs to one shard
+#define CSL_BACKUP_MERGE 8
+#define CSL_SEG_MAP_SIZE (BITS_TO_LONGS(CSL_SEGMENT_SECTORS) * sizeof(unsigned long)) // free_map words of a segment
+
+/* The logical capacity is a multiple of this, so there is no partial L2P block */
+static_assert((CSL_SEGMENT_SECTORS * CSL_NR_SHARDS) % CSL_L2P_BLOCK == 0);
+static_assert(CSL_SEGMENT_SECTORS % BITS_PER_LONG == 0);
+
+/*
+* OUT-OF-BAND CONSTANT
+*
+* dev->p2l doubles as the out-of-band tag of every used sector, the LBA it was written for
+* or CSL_UNMAPPED once it is invalid. Every segment also keeps the shard clock of when it was opened,
+* so of two sectors tagged with one LBA the one allocated later is known.
+* Backups carry both next to the data, so the mapping can be rebuilt from them alone.
+*/
+#define CSL_OOB_TAG_SIZE (CSL_SEGMENT_SECTORS * sizeof(u32)) // tags of a segment
+#define CSL_DELTA_NO_DATA (1U << 31) // a segment of a delta which only has new tags, its data did not change
+
+/* With lazy_restore, the data of a used segment stays in the backup files until it is needed */
+#define CSL_LAZY_DELTA (1ULL << 62) // the offset of the segment is in the delta file
+#define L2P_ENTRY_SIZE 2 * sizeof(unsigned int)
 #define GC_ENTRY_SIZE sizeof(unsigned int)
 
+/*
+* JOURNAL CONSTANT
+*
+* Between two backups, the content of every LBA written or trimmed is appended to the journal
+* when a FLUSH or FUA request asks for it. The backup image and the journal share an epoch,
+* records of any other epoch are stale. Once the journal is journal_mb large, a new backup is taken.
+*
+* There are two journal files. A checkpoint starts the next epoch in the other file while its backup
+* is written, so a crash meanwhile replays the old backup, its journal and then the new one.
+*/
+#define JOURNAL_FILE_PATH "/dev/csl_journal" // file 0, file 1 has ".1" appended
+#define CSL_JOURNAL_MAGIC 0x43534c4a // "CSLJ"
+#define CSL_JOURNAL_DEFAULT_MB 64
+#define CSL_JOURNAL_SECTORS CSL_SHARD_STRIPE // the largest record
+#define CSL_JOURNAL_DATA 0
+#define CSL_JOURNAL_TRIM 1
+
+/*
+* CHECKPOINT CONSTANT
+*
+* The checkpoint thread takes a backup every ckpt_interval seconds if something changed,
+* and when the journal is journal_mb large. The mapping is copied one shard at a time under its lock,
+* then the data is written from the device memory at ckpt_rate_mb while I/O goes on.
+* Segments in the copy are pinned, GC does not reuse them until their data is written.
+*/
+#define CSL_CKPT_INTERVAL 60 // seconds
+#define CSL_CKPT_RATE_MB 256 // MB per second written by a background checkpoint
+
 
 /*
 * ERROR MSG
@@ -47,58 +223,400 @@ MODULE_LICENSE("GPL");
 
 #define BACKUP_FAIL_MSG "CSL : FAIL TO BACK UP CSL"
 
+/* Position in the data of a request */
+struct csl_rq_iter{
+	struct bio *bio;
+	struct bvec_iter iter;
+};
+
+/* Header of a journal record, followed by nr sectors of data for CSL_JOURNAL_DATA */
+struct csl_journal_rec{
+	u32 magic;
+	u32 epoch;
+	u32 lba;
+	u32 nr;
+	u32 type;
+	u32 crc; // crc32 of the header with crc 0 and the data
+};
+
+/* Header of a delta, a trailer of magic and epoch ends it at length bytes */
+struct csl_delta_hdr{
+	u32 magic;
+	u32 epoch;
+	u32 nr_blocks;	// L2P blocks, each is an index and CSL_L2P_BLOCK entries
+	u32 nr_segs;	// segments, each is an index, its free_map words and its data if it is used
+	u64 length;
+};
+
+/* A backup being taken, the mapping is copied by csl_backup_snapshot() */
+struct csl_ckpt{
+	u32 epoch;
+	bool full;	// a full backup, a delta otherwise
+
+	// Copy of the mapping, only the dirty blocks and segments for a delta
+	u32 *l2p;
+	unsigned long *free_map;
+	u32 *p2l;	// tags of the sectors
+	u64 *seq;	// sequence of the segments
+
+	// Dirty blocks and segments taken from the device, given back if the backup fails
+	unsigned long *dirty_l2p;
+	unsigned long *dirty_segs;
+	unsigned long *dirty_oob;	// segments with only new tags, not in dirty_segs
+
+	// Write rate limit in MB per second, 0 for none
+	unsigned int rate_mb;
+	unsigned long start;
+	u64 bytes;
+};
+
+struct csl_journal{
+	struct file *file[2];
+	unsigned int cur;	// file which takes the records
+	loff_t pos;	// end of the last record
+	u32 epoch;	// epoch of the current file
+	u32 ckpt_epoch;	// epoch of the last complete backup, one behind epoch while a backup is written
+
+	// File access, a commit and a checkpoint never overlap
+	struct mutex mutex;
+
+	// FLUSH and FUA requests waiting for the next commit
+	spinlock_t lock;
+	struct list_head rqs;
+
+	struct workqueue_struct *wq;
+	struct work_struct work;
+
+	// Background checkpoint
+	struct task_struct *ckpt_thread;
+	wait_queue_head_t ckpt_wait;
+
+	// Dirty LBAs, a word belongs to one shard and is changed under its lock
+	unsigned long *dirty_map;
+	// Stripes which have a dirty LBA
+	unsigned long *dirty_stripes;
+
+	// Data of one record
+	void *buf;
+};
+
+struct csl_segment{
+	// Write pointer, sectors [0, wp) of the segment are already used
+	unsigned int wp;
+
+	// The number of sectors in [0, wp) still mapped by the L2P table
+	unsigned int valid;
+
+	// shard->clock of the last allocation, used as the age of the segment
+	u64 mtime;
+
+	// shard->clock when the segment was opened, its sectors are newer than those of older segments
+	u64 seq;
+
+	// Entry of shard->free_segs while the segment is free
+	struct list_head list;
+};
+
+struct csl_shard{
+	spinlock_t lock;
+
+	// Bumped on every remap, lets readers run without the lock
+	seqcount_spinlock_t seq;
+
+	// First physical sector owned by this shard
+	unsigned int base;
+
+	// Segment which takes the next write, NULL if none is open
+	struct csl_segment *open;
+
+	// Segments without any used sector
+	struct list_head free_segs;
+	unsigned int nr_free_segs;
+
+	// Counts allocations, the clock for segment age
+	u64 clock;
+
+	// Segment being cleaned and the next sector of it to look at
+	struct csl_segment *gc_victim;
+	unsigned int gc_cursor;
+
+	// Background GC of this shard
+	struct work_struct gc_work;
+} ____cacheline_aligned_in_smp;
+
+/* Per-CPU counters, summed when they are read from /sys/block/CSL/csl */
+enum csl_stat{
+	CSL_STAT_READS,
+	CSL_STAT_WRITES,
+	CSL_STAT_READ_BYTES,
+	CSL_STAT_WRITE_BYTES,
+	CSL_STAT_MAP_INSERTS,	// writes to an LBA which was unmapped
+	CSL_STAT_MAP_UPDATES,	// writes to an LBA which was mapped
+	CSL_STAT_INVALIDATES,
+	CSL_STAT_TRIMMED,	// mapped sectors dropped by discard and write zeroes
+	CSL_STAT_GC_CALLS,	// GC steps which had a victim to clean
+	CSL_STAT_GC_RECLAIMED,	// sectors of the segments GC gave back
+	CSL_STAT_ALLOC_FAILS,	// writes which found no capacity
+	CSL_STAT_HOST_WRITES,	// sectors written by the host
+	CSL_STAT_ZERO_WRITES,	// sectors written by the host which were zeroes and got no physical sector
+	CSL_STAT_MEDIA_WRITES,	// sectors written by the host and by GC migration
+	CSL_STAT_GC_WRITES,	// sectors written by GC migration
+	CSL_STAT_CZ_PAGES,	// pages the compressor went over
+	CSL_STAT_CZ_BYTES,	// bytes they take after it, PAGE_SIZE for the ones kept raw
+	CSL_STAT_CZ_RAW,	// pages kept raw
+	CSL_STAT_CZ_NS,	// time spent compressing
+	CSL_STAT_DD_LOOKUPS,	// sectors looked up in the dedup index
+	CSL_STAT_DD_HITS,	// sectors which were already on the device and were not written
+	CSL_NR_STATS
+};
+
+/* Stages timed for the latency histograms, and for the tracepoints of csl_trace.h */
+enum csl_lat{
+	CSL_LAT_LOCK,	// wait for a shard lock
+	CSL_LAT_MAP,	// mapping update of a write
+	CSL_LAT_ALLOC,	// sector allocation, with the GC it runs
+	CSL_LAT_COPY,	// data copy between the request and the device memory
+	CSL_LAT_GC,	// a GC step, also part of the allocation which ran it
+	CSL_LAT_REQUEST,	// the whole request in the submitting context
+	CSL_NR_LAT
+};
+
+#define CSL_HIST_BUCKETS 32 // bucket i counts [2^i, 2^(i+1)) ns, the last one everything above
+
+struct csl_stats{
+	u64 v[CSL_NR_STATS];
+	u64 hist[CSL_NR_LAT][CSL_HIST_BUCKETS];
+};
+
+/* No lock, no atomic, the counter of the local CPU */
+#define csl_stat_add(idx, n) this_cpu_add(dev->stats->v[idx], n)
+
+/* A compressed page, freed after a grace period since reads look at it without a lock */
+struct csl_zpage{
+	struct rcu_head rcu;
+	unsigned int len;
+	u8 data[];
+};
+
+/* Decompression context and buffer of a CPU */
+struct csl_zstrm{
+	struct crypto_comp *tfm;
+	u8 *buf;	// one page
+};
+
+/* A bucket of the dedup index, the sector which last had data of this hash */
+struct csl_dd_entry{
+	u32 ppn;	// CSL_UNMAPPED if empty
+	u32 tag;	// upper half of the hash
+};
+
+/* A poll queue, its requests are completed by csl_poll() instead of in csl_enqueue() */
+struct csl_pollq{
+	spinlock_t lock;
+	struct list_head rqs;
+} ____cacheline_aligned_in_smp;
+
+/* Per request data, the status of a request waiting on a poll queue */
+struct csl_cmd{
+	blk_status_t status;
+};
+
 struct csl_dev{
 	struct request_queue *queue;
 	struct gendisk *gdisk;
 	
 	struct blk_mq_tag_set tag_set; // request queue의 tag set
+	struct csl_pollq *pollqs;	// one for each poll hardware queue, after the default ones
+	unsigned int nr_poll_queues;
 
-	spinlock_t csl_lock;
+	// Geometry, set once by csl_alloc() from the capacity
+	unsigned int sector_num;	// physical sectors
+	unsigned int segment_num;
+	unsigned int lba_num;		// logical sectors exposed to the host
+	unsigned int shard_sector_num;
+	unsigned int shard_segment_num;
 
 	// Bitmap for manage free sectors
 	unsigned long *free_map; 
-	
-	// Doubly linked list for garbage collection 
-	struct list_head list;
 
-	// XArray for logical block to physical page
-	struct xarray l2p_map;
+	// Allocation state of every segment
+	struct csl_segment *segs;
 
-	// Actual Data Array
-	u8 *data;
-};
+	// Runs the background GC of every shard
+	struct workqueue_struct *gc_wq;
 
-struct l2b_item{
-	unsigned long lba; 
-	unsigned int ppn;
-};
+	// FTL state partitioned by LBA stripe
+	struct csl_shard shards[CSL_NR_SHARDS];
+
+	// Flat L2P table indexed by LBA, CSL_UNMAPPED if never written
+	u32 *l2p;
+
+	// Reverse map indexed by PPN and out-of-band tag of the sector, CSL_UNMAPPED once it is invalid
+	u32 *p2l;
+
+	// Bitmap of physical sectors which hold valid data
+	unsigned long *valid_map;
+
+	// Actual Data, one chunk per 2^chunk_shift physical sectors, NULL until its segment is used
+	// or while its page is compressed
+	struct page **chunks;
+	unsigned int nr_chunks;
+	unsigned int chunk_order;	// pages per chunk, as an order
+	unsigned int chunk_shift;	// sectors per chunk, as a shift
+
+	// Compression, zpages is NULL if it is off
+	struct csl_zpage __rcu **zpages;	// one per page, set while the page is compressed
+	unsigned long *cz_todo;	// closed segments to compress
+	struct crypto_comp *cz_tfm;	// compression, only the work uses it
+	u8 *cz_buf;
+	struct csl_zstrm __percpu *zstrm;	// decompression
+	struct delayed_work cz_work;
+
+	// Dedup, dd_refs is NULL if it is off
+	u16 *dd_refs;	// LBAs which map each physical sector
+	u32 *dd_next;	// next LBA which maps the same sector, the first one is its p2l entry
+	u32 *dd_prev;	// previous one, CSL_UNMAPPED for the first
+	struct csl_dd_entry *dd_index;	// 2^dd_bits buckets per shard
+	u32 *dd_bucket;	// bucket of dd_index each physical sector was put in, CSL_UNMAPPED if none
+	unsigned int dd_bits;
+	u8 *dd_buf;	// two sectors per shard, the data written and the data it is compared with
+
+	// Write-ahead journal of the changes since the last backup
+	struct csl_journal journal;
+
+	// Segments and L2P blocks changed since the last backup, for the next delta
+	unsigned long *dirty_segs;
+	unsigned long *dirty_l2p;
+	unsigned long *dirty_oob;	// segments which only had sectors invalidated
+
+	// The backup file is a full backup, the deltas on top of it end at delta_pos
+	bool has_full;
+	unsigned int full_slot;	// slot of the last full backup
+	unsigned int nr_deltas;
+	loff_t delta_pos;
+
+	// Segments a checkpoint still has to write, GC leaves them alone
+	unsigned long *ckpt_pin;
+
+	// I/O and FTL counters
+	struct csl_stats __percpu *stats;
 
-struct list_item{
-	unsigned int sector;
-	struct list_head list_head;
+	// Lazy restore, segments in lazy_map still have their data in the backup files
+	unsigned long *lazy_map;
+	loff_t *lazy_src;	// where the data of a segment is, CSL_LAZY_DELTA for the delta file
+	unsigned int lazy_left;	// segments in lazy_map, changed under lazy_mutex
+	unsigned int lazy_cursor;	// next segment to prefetch
+	struct file *lazy_file[2];	// full backup and deltas
+	struct mutex lazy_mutex;
+
+	// Reads which wait for their segments
+	spinlock_t lazy_lock;
+	struct list_head lazy_rqs;
+	struct work_struct lazy_work;
 };
 
 
+extern struct csl_dev *dev;
+
 /**
  * The function of csl.c
  * Block operation of device
  */
-unsigned long find_free_sector(unsigned int size);
+struct csl_shard *csl_get_shard(unsigned int lba);
+unsigned int csl_ppn_to_shard(unsigned int ppn);
+unsigned int csl_seg_to_ppn(struct csl_segment *seg);
+int csl_alloc_backing(struct csl_segment *seg, gfp_t gfp);
+void* csl_sector_addr(unsigned int ppn);
+void csl_copy_sectors(uint ppn, struct csl_rq_iter *it, uint num_sec, int isWrite);
+void csl_copy_out(unsigned int ppn, void *dst, unsigned int nr);
+int csl_init_segments(void);
+unsigned long find_free_sector(struct csl_shard *shard, unsigned int size, int isGC);
 void display_index(void);
-uint csl_gc(void);
-void csl_invalidate(unsigned int ppn);
-void csl_read(uint ppn, void* buf, uint num_sec);
-unsigned int csl_write(void* buf, uint num_sec);
-void csl_transfer(unsigned int start_sec, unsigned int num_sec, void* buffer, int isWrite);
-void csl_get_request(struct request *rq);
+void csl_invalidate(struct csl_shard *shard, unsigned int ppn, unsigned int lba);
+void csl_rq_copy(struct csl_rq_iter *it, void* data, uint nbytes, int isWrite);
+void csl_read(uint ppn, struct csl_rq_iter *it, uint num_sec);
+unsigned int csl_write(struct csl_shard *shard, struct csl_rq_iter *it, uint num_sec);
+void csl_shard_read(struct csl_shard *shard, unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it);
+int csl_shard_transfer(struct csl_shard *shard, unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it, int isWrite);
+int csl_transfer(unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it, int isWrite, struct csl_shard **locked);
+void csl_discard(unsigned int start_sec, unsigned int num_sec);
+blk_status_t csl_get_request(struct request *rq, struct csl_shard **locked);
 blk_status_t csl_enqueue(struct blk_mq_hw_ctx *ctx, const struct blk_mq_queue_data *data);
+void csl_end_request(struct request *rq, blk_status_t status);
 void bits_print(unsigned long *v, u32 nbits);
 
 
+//The functions of gc.c
+
+int csl_gc_step(struct csl_shard *shard, unsigned int budget);
+int csl_gc(struct csl_shard *shard);
+void csl_gc_throttle(struct csl_shard *shard, unsigned int num_sec);
+void csl_gc_work(struct work_struct *work);
+void csl_report_waf(void);
+
 //The functions of backup.c
 
-int read_from_file(char* filename, void* data, size_t size);
-void csl_restore(struct csl_dev *dev);
-int write_to_file(const char *filename, const void *data, size_t size);
-void csl_backup(struct csl_dev *dev);
+int read_from_file(struct file* file, void* data, size_t size, loff_t *pos);
+int csl_restore(struct csl_dev *dev);
+int write_to_file(struct file *file, const void *data, size_t size, loff_t *pos);
+struct csl_ckpt *csl_backup_begin(struct csl_dev *dev, unsigned int rate_mb);
+void csl_backup_snapshot(struct csl_dev *dev, struct csl_ckpt *ckpt);
+int csl_backup_write(struct csl_dev *dev, struct csl_ckpt *ckpt);
+bool csl_backup_dirty(struct csl_dev *dev);
+bool csl_seg_pinned(unsigned int seg);
+void csl_backup_mark_seg(unsigned int seg);
+void csl_backup_mark_l2p(unsigned int lba);
+void csl_backup_mark_oob(unsigned int seg);
+bool csl_seg_lazy(unsigned int seg);
+bool csl_lazy_needed(unsigned int lba, unsigned int nr);
+int csl_lazy_load_lbas(unsigned int lba, unsigned int nr);
+void csl_lazy_defer_rq(struct request *rq);
+void csl_lazy_work(struct work_struct *work);
+void csl_lazy_exit(struct csl_dev *dev);
+
+
+//The functions of journal.c
+
+int csl_journal_init(struct csl_dev *dev);
+void csl_journal_exit(struct csl_dev *dev);
+void csl_journal_replay(void);
+void csl_journal_mark(unsigned int lba, unsigned int nr);
+void csl_journal_sync_rq(struct request *rq, bool kick);
+void csl_journal_kick(void);
+void csl_journal_work(struct work_struct *work);
+int csl_checkpoint(bool online);
+int csl_ckpt_start(void);
+void csl_ckpt_stop(void);
+
+
+//The functions of compress.c
+
+int csl_compress_init(struct csl_dev *dev);
+void csl_compress_exit(struct csl_dev *dev);
+void csl_compress_mark(unsigned int seg);
+void csl_compress_all(void);
+void csl_compress_release(unsigned int seg);
+void *csl_zpage_get(unsigned int pg);
+void csl_zpage_put(void);
+void csl_compress_work(struct work_struct *work);
+
+
+//The functions of dedup.c
+
+int csl_dedup_init(struct csl_dev *dev, bool force);
+void csl_dedup_exit(struct csl_dev *dev);
+bool csl_dedup_unref(unsigned int ppn, unsigned int lba);
+void csl_dedup_link(unsigned int ppn, unsigned int lba);
+int csl_dedup_write(struct csl_shard *shard, unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it);
+void csl_dedup_move(unsigned int ppn, unsigned int ppn_new);
+
+
+//The functions of stats.c
+
+extern const struct attribute_group *csl_attr_groups[];
+u64 csl_stat_sum(enum csl_stat idx);
+u64 csl_lat_start(void);
+u64 csl_lat_end(enum csl_lat stage, u64 start);
+void csl_debugfs_init(void);
+void csl_debugfs_exit(void);
 
@@ -8,38 +8,249 @@
 #include <linux/err.h>
 #include <linux/bitmap.h>
 #include <linux/spinlock.h>
+#include <linux/moduleparam.h>
+#include <linux/highmem.h>
 
 #include "csl.h"
+#include "csl_trace.h"
 
 static int CSL_MAJOR = 0; // save the major number of the device
 
+static unsigned int capacity_mb = CSL_DEFAULT_CAPACITY_MB;
+module_param(capacity_mb, uint, 0444);
+MODULE_PARM_DESC(capacity_mb, "physical capacity of the device in MB, memory is allocated as it is written");
+
+static bool huge_backing = false;
+module_param(huge_backing, bool, 0444);
+MODULE_PARM_DESC(huge_backing, "back the whole device with 2MB pages at load time, falls back to 4KB pages on demand");
+
+static unsigned int poll_queues = 1;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "hardware queues for polled I/O (io_uring IOPOLL), 0 for none");
+
+static bool dump_mapping = false;
+module_param(dump_mapping, bool, 0644);
+MODULE_PARM_DESC(dump_mapping, "print every mapped LBA after restore and at unload, counters are in /sys/block/CSL/csl");
+
 struct csl_dev *dev;
-DEFINE_SPINLOCK(csl_lock);
 
 struct queue_limits queue_limit = {
 		.logical_block_size	= 512,
+		.max_hw_sectors		= CSL_MAX_HW_SECTORS,
+		.max_segments		= CSL_MAX_HW_SECTORS / PAGE_SECTORS,
+		/* Trimming only touches the mapping, but queue_rq can not sleep, so the work of one request is bounded */
+		.max_hw_discard_sectors	= CSL_MAX_DISCARD_SECTORS,
+		.max_write_zeroes_sectors = CSL_MAX_DISCARD_SECTORS,
+		.discard_granularity	= 512,
 	};
 
 /**
- * find_free_sector() : find free sectors matching with given size. 
+ * csl_get_shard() : get the shard which owns given logical block
+ * 
+ * @lba : the logical sector number
+ */
+struct csl_shard *csl_get_shard(unsigned int lba)
+{
+	return &dev->shards[(lba / CSL_SHARD_STRIPE) % CSL_NR_SHARDS];
+}
+
+/**
+ * csl_ppn_to_shard() : get the index of the shard which owns given physical sector
+ * 
+ * @ppn : the physical sector number
+ */
+unsigned int csl_ppn_to_shard(unsigned int ppn)
+{
+	return ppn / dev->shard_sector_num;
+}
+
+/**
+ * csl_seg_to_ppn() : get the first physical sector of a segment
+ * 
+ * @seg : the segment
+ */
+unsigned int csl_seg_to_ppn(struct csl_segment *seg)
+{
+	return (seg - dev->segs) * CSL_SEGMENT_SECTORS;
+}
+
+/**
+ * csl_sector_addr() : get the kernel address of a physical sector
+ * 
+ * @ppn : the physical sector number, its segment must have backing pages
+ * 
+ * Chunks are in the direct map, so this is a shift, a mask and one table load.
+ */
+void* csl_sector_addr(unsigned int ppn)
+{
+	unsigned int offset = ppn & ((1U << dev->chunk_shift) - 1);
+
+	return page_address(dev->chunks[ppn >> dev->chunk_shift]) + offset * SECTOR_SIZE;
+}
+
+/**
+ * csl_alloc_backing() : allocate the chunks of a segment which were never used
+ * 
+ * @seg : the segment
+ * @gfp : GFP_NOWAIT under the shard lock, GFP_KERNEL otherwise
  * 
+ * Chunks stay with the segment once allocated, GC reuses them without going back to the allocator.
+ * With huge_backing every chunk is already there.
+ * return : SUCCESS_EXIT, or FAIL_EXIT if a chunk could not be allocated
+ */
+int csl_alloc_backing(struct csl_segment *seg, gfp_t gfp)
+{
+	unsigned int first = csl_seg_to_ppn(seg) >> dev->chunk_shift;
+	unsigned int last = (csl_seg_to_ppn(seg) + CSL_SEGMENT_SECTORS - 1) >> dev->chunk_shift;
+	struct page *page;
+	unsigned int i;
+
+	for(i = first; i <= last; i++){
+		if(dev->chunks[i]) continue;
+
+		page = alloc_pages(gfp | __GFP_ZERO, dev->chunk_order);
+		if(!page) return FAIL_EXIT;
+
+		dev->chunks[i] = page;
+	}
+
+	return SUCCESS_EXIT;
+}
+
+/**
+ * csl_init_segments() : rebuild the segment state from dev->free_map and the L2P table
+ * 
+ * A segment without any used sector goes to the free list of its shard.
+ * Others are closed with the write pointer after their last used sector.
+ * The reverse map and the valid count of each segment come from the L2P table,
+ * and the clock of each shard goes on from its newest segment.
+ * LBAs which map the same sector were written with dedup, it is turned on for them if it is off.
+ * return : SUCCESS_EXIT, or FAIL_EXIT if some LBAs which share a sector can not be tracked,
+ *          the L2P table is left as it is so the caller can give up without losing them
+ */
+int csl_init_segments(void)
+{
+	struct csl_segment *seg;
+	struct csl_shard *shard;
+	unsigned long last;
+	unsigned int lba, lost = 0;
+	u32 ppn;
+	int i;
+
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		shard = &dev->shards[i];
+		shard->open = NULL;
+		shard->gc_victim = NULL;
+		shard->nr_free_segs = 0;
+		shard->clock = 0;
+		INIT_LIST_HEAD(&shard->free_segs);
+	}
+
+	for(i = 0; i < dev->segment_num; i++){
+		seg = &dev->segs[i];
+		shard = &dev->shards[csl_ppn_to_shard(csl_seg_to_ppn(seg))];
+
+		last = find_last_bit(dev->free_map + BIT_WORD(csl_seg_to_ppn(seg)), CSL_SEGMENT_SECTORS);
+		seg->wp = (last == CSL_SEGMENT_SECTORS) ? 0 : last + 1;
+		seg->valid = 0;
+		seg->mtime = 0;
+		shard->clock = max(shard->clock, seg->seq);
+
+		if(seg->wp == 0){
+			list_add_tail(&seg->list, &shard->free_segs);
+			shard->nr_free_segs++;
+		}
+		else {
+			INIT_LIST_HEAD(&seg->list);
+		}
+	}
+
+again:
+	bitmap_zero(dev->valid_map, dev->sector_num);
+	memset(dev->p2l, 0xff, dev->sector_num * sizeof(u32)); // CSL_UNMAPPED
+	if(dev->dd_refs){
+		memset(dev->dd_refs, 0, dev->sector_num * sizeof(u16));
+		memset(dev->dd_next, 0xff, dev->lba_num * sizeof(u32));
+		memset(dev->dd_prev, 0xff, dev->lba_num * sizeof(u32));
+	}
+	for(i = 0; i < dev->segment_num; i++) dev->segs[i].valid = 0;
+
+	for(lba = 0; lba < dev->lba_num; lba++){
+		ppn = dev->l2p[lba];
+		if(!csl_l2p_mapped(ppn)) continue;
+
+		if(test_bit(ppn, dev->valid_map)){
+			if(dev->dd_refs == NULL && csl_dedup_init(dev, true) == SUCCESS_EXIT){
+				pr_warn("CSL : LBAS SHARE SECTORS, DEDUP IS TURNED ON");
+				goto again;
+			}
+
+			/* Without memory for the chains, or past the reference limit, the LBA can not be kept */
+			if(dev->dd_refs == NULL || dev->dd_refs[ppn] == U16_MAX) lost++;
+			else csl_dedup_link(ppn, lba);
+			continue;
+		}
+
+		if(dev->dd_refs) csl_dedup_link(ppn, lba);
+		else dev->p2l[ppn] = lba;
+		__set_bit(ppn, dev->valid_map);
+		dev->segs[ppn / CSL_SEGMENT_SECTORS].valid++;
+	}
+
+	if(lost){
+		pr_warn("CSL : %u LBAS SHARE SECTORS WHICH CAN NOT BE TRACKED", lost);
+		return FAIL_EXIT;
+	}
+
+	return SUCCESS_EXIT;
+}
+
+/**
+ * find_free_sector() : take free sectors from the append point of the shard. 
+ * 
+ * @shard : the shard to allocate from, caller holds shard->lock
  * @size : the number of sectors we need
+ * @isGC : the sectors are for GC migration, which may use the reserved segments
  *  
+ * Sectors come from the write pointer of the open segment, so it is O(1) however full the device is.
+ * If the open segment can not hold size sectors, only its tail is taken, csl_alloc_len() tells how many,
+ * and the caller asks again for the rest. The next free segment is opened once the open one is full.
+ * return : the first sector, OUT_OF_SECTOR if there is no free segment, OUT_OF_MEMORY if its pages can not be allocated
  */
-unsigned long find_free_sector(unsigned int size)
+unsigned long find_free_sector(struct csl_shard *shard, unsigned int size, int isGC)
 {
-	/* check there is free sector */
-	if(bitmap_full(dev->free_map, DEV_SECTOR_NUM)) return OUT_OF_SECTOR;
+	struct csl_segment *seg = shard->open;
+	unsigned long ppn;
 
-	unsigned long bit;
+	if(seg == NULL || seg->wp == CSL_SEGMENT_SECTORS){
+		/* check there is free segment, host writes leave the reserve to GC */
+		if(list_empty(&shard->free_segs)) return OUT_OF_SECTOR;
+		if(!isGC && shard->nr_free_segs <= CSL_GC_RESERVE) return OUT_OF_SECTOR;
 
-	bit = bitmap_find_next_zero_area(dev->free_map, DEV_SECTOR_NUM, 0, size, 0);
-	
-	if(bit > DEV_SECTOR_NUM - size) return FAIL_EXIT; // check it is valid sector start number
+		seg = list_first_entry(&shard->free_segs, struct csl_segment, list);
 
-	bitmap_set(dev->free_map, bit, size); 
+		/* We hold the shard lock, so the pages of a new segment must come without sleeping */
+		if(csl_alloc_backing(seg, GFP_NOWAIT | __GFP_NOWARN) < 0) return OUT_OF_MEMORY;
 
-	return bit;
+		list_del_init(&seg->list);
+		shard->nr_free_segs--;
+		if(shard->open) csl_compress_mark(shard->open - dev->segs);
+		shard->open = seg;
+		seg->seq = shard->clock + 1;
+	}
+
+	ppn = csl_seg_to_ppn(seg) + seg->wp;
+	size = csl_alloc_len(ppn, size);
+	seg->wp += size;
+	seg->valid += size;
+	seg->mtime = ++shard->clock;
+
+	bitmap_set(dev->valid_map, ppn, size);
+
+	bitmap_set(dev->free_map, ppn, size); 
+	csl_backup_mark_seg(ppn / CSL_SEGMENT_SECTORS);
+
+	return ppn;
 }
 
 /*
@@ -47,14 +258,10 @@ unsigned long find_free_sector(unsigned int size)
 */
 void display_index(void)
 {
-    unsigned long lba;
-    void* ret;
-    struct l2b_item* data;
+    unsigned int lba;
+    u32 ppn;
 
-    if(xa_empty(&dev->l2p_map)){
-        pr_info("CSL : THERE IS NO ALLOCATE SECTOR");
-        return;
-    }
+    if(!dump_mapping) return;
 
     pr_info("CSL : MAPPING INFO");
     pr_info("-----------------------------------------");
@@ -62,111 +269,240 @@ void display_index(void)
     pr_info("     %-10s   |     %-10s  |", "LBA", "PPN");
     pr_info("-----------------------------------------");
 
-    xa_lock(&dev->l2p_map);
-    xa_for_each(&dev->l2p_map, lba, ret)
+    for(lba = 0; lba < dev->lba_num; lba++)
     {
-        data = (struct l2b_item*) ret;
-        pr_info("     %-10lu   |     %-10d   |", data->lba, data->ppn);
+        ppn = READ_ONCE(dev->l2p[lba]);
+        if(ppn == CSL_UNMAPPED) continue;
+        if(ppn == CSL_ZERO) pr_info("     %-10u   |     %-10s   |", lba, "zero");
+        else pr_info("     %-10u   |     %-10u   |", lba, ppn);
     }
 
     pr_info("-----------------------------------------");
-    xa_unlock(&dev->l2p_map);
 }
 
 
-/*
-* csl_gc() : Operate Garbage Collection to use a free page
-* return : a sector number of free page 
-*/
+/** 
+* csl_invalidate() : Invalidate a sector
+* @shard : the shard which owns the sector
+* @ppn : the sector number
+* @lba : the LBA which leaves the sector, CSL_UNMAPPED if all of them do
+*
+* Just a bit, a counter and the tag, the data stays where it is until GC reclaims the whole segment.
+* A dead tag keeps the old copy out of a mapping rebuilt from the tags.
+* With dedup, a sector other LBAs still map only loses a reference.
+**/
 
-uint csl_gc(void)
+void csl_invalidate(struct csl_shard *shard, unsigned int ppn, unsigned int lba)
 {
-	struct list_item *entry;
+	if(dev->dd_refs && lba != CSL_UNMAPPED && csl_dedup_unref(ppn, lba)) return;
 
-	if(!list_empty(&dev->list))
-	{
-		unsigned int ppn_new;
-		entry = list_first_entry(&dev->list, struct list_item, list_head);
-		ppn_new = entry->sector;
-		list_del(&entry->list_head);
-		return ppn_new;
-	}
+	__clear_bit(ppn, dev->valid_map);
+	dev->segs[ppn / CSL_SEGMENT_SECTORS].valid--;
 
-	return OUT_OF_SECTOR;
+	dev->p2l[ppn] = CSL_UNMAPPED;
+	csl_backup_mark_oob(ppn / CSL_SEGMENT_SECTORS);
+	csl_stat_add(CSL_STAT_INVALIDATES, 1);
 }
 
-/** 
-* csl_invalidate() : Invalidate a sector
-* @ppn : the sector number
-**/
+/**
+ * csl_rq_copy() : copy between device memory and the pages of a request
+ * 
+ * @it : position in the request, advanced by nbytes
+ * @data : device memory, NULL to zero nbytes of the request for a read, or to skip them for a write
+ * @nbytes : how many bytes to copy
+ * @isWrite : copy from the request to data if set, from data to the request if not
+ * 
+ * Request pages may be highmem or part of a large folio, so each one is mapped with kmap_local_page().
+ * A whole request page against a page aligned sector is moved with copy_page(),
+ * sub-page I/O takes the byte copy.
+ */
+void csl_rq_copy(struct csl_rq_iter *it, void* data, uint nbytes, int isWrite)
+{
+	struct bio_vec bvec;
+	void* buffer;
+	uint len;
+
+	while(nbytes){
+		bvec = bio_iter_iovec(it->bio, it->iter);
+		len = min(bvec.bv_len, nbytes);
+
+		if(data){
+			buffer = kmap_local_page(bvec.bv_page);
+
+			if(len == PAGE_SIZE && PAGE_ALIGNED(data)){
+				if(isWrite) copy_page(data, buffer);
+				else copy_page(buffer, data);
+			}
+			else {
+				if(isWrite) memcpy(data, buffer + bvec.bv_offset, len);
+				else memcpy(buffer + bvec.bv_offset, data, len);
+			}
+
+			kunmap_local(buffer);
+			data += len;
+		}
+		else if(!isWrite){
+			memzero_page(bvec.bv_page, bvec.bv_offset, len);
+		}
+		nbytes -= len;
+
+		bio_advance_iter_single(it->bio, &it->iter, len);
+		if(it->iter.bi_size == 0 && it->bio->bi_next){
+			it->bio = it->bio->bi_next;
+			it->iter = it->bio->bi_iter;
+		}
+	}
+}
+
+/**
+ * csl_read_chunk() : copy sectors of one chunk to the request
+ * 
+ * @ppn : the first physical sector
+ * @it : position in the request, advanced past them
+ * @nr : how many sectors, within the chunk of ppn
+ * 
+ * A chunk which is gone was compressed, it is decompressed to the buffer of this CPU.
+ * The compressor frees a raw chunk a grace period after it is gone, so it is looked at under RCU.
+ */
+static void csl_read_chunk(unsigned int ppn, struct csl_rq_iter *it, unsigned int nr)
+{
+	unsigned int offset = (ppn & ((1U << dev->chunk_shift) - 1)) * SECTOR_SIZE;
+	struct page *chunk;
+	void *data;
+
+	rcu_read_lock();
+	chunk = smp_load_acquire(&dev->chunks[ppn >> dev->chunk_shift]);
+	if(chunk){
+		csl_rq_copy(it, page_address(chunk) + offset, nr * SECTOR_SIZE, 0);
+	}
+	else {
+		data = csl_zpage_get(ppn >> dev->chunk_shift);
+		csl_rq_copy(it, data ? data + offset : NULL, nr * SECTOR_SIZE, 0);
+		csl_zpage_put();
+	}
+	rcu_read_unlock();
+}
 
-void csl_invalidate(unsigned int ppn)
+/**
+ * csl_copy_sectors() : copy between physical sectors and the request
+ * 
+ * @ppn : the start sector number
+ * @it : position in the request
+ * @num_sec : how many sectors to copy, all of them must have backing pages or be compressed
+ * @isWrite : copy from the request to the device if set
+ * 
+ * Chunks are not contiguous with each other, so the copy is split at chunk boundaries.
+ */
+void csl_copy_sectors(uint ppn, struct csl_rq_iter *it, uint num_sec, int isWrite)
 {
-	struct list_item *item;
+	uint chunk_sectors = 1U << dev->chunk_shift;
+	uint first = ppn, nr = num_sec;
+	uint run;
+	u64 t = csl_lat_start();
 
-	item = kmalloc(sizeof(struct list_item), GFP_KERNEL);
+	while(num_sec){
+		run = min(num_sec, chunk_sectors - (ppn & (chunk_sectors - 1)));
 
-	if(IS_ERR(item) || item == NULL) {
-		pr_warn("CSL : Fail To Allocate list item !");
-		return;
+		/* Only closed segments are compressed, a write goes to the open one */
+		if(isWrite) csl_rq_copy(it, csl_sector_addr(ppn), run * SECTOR_SIZE, isWrite);
+		else csl_read_chunk(ppn, it, run);
+
+		ppn += run;
+		num_sec -= run;
 	}
 
-	item->sector = ppn;
-	list_add_tail(&item->list_head, &dev->list);
-	
+	trace_csl_copy(first, nr, isWrite, csl_lat_end(CSL_LAT_COPY, t));
 }
 
 /**
- * csl_read() : Read to buf
+ * csl_copy_out() : copy sectors of one chunk out of the device memory
+ * 
+ * @ppn : the first physical sector
+ * @dst : where to copy them
+ * @nr : how many sectors, within the chunk of ppn
+ * 
+ * Used where the data is needed in memory rather than in a request, by GC and the backup.
+ */
+void csl_copy_out(unsigned int ppn, void *dst, unsigned int nr)
+{
+	unsigned int offset = (ppn & ((1U << dev->chunk_shift) - 1)) * SECTOR_SIZE;
+	struct page *chunk;
+	void *data;
+
+	rcu_read_lock();
+	chunk = smp_load_acquire(&dev->chunks[ppn >> dev->chunk_shift]);
+	if(chunk){
+		memcpy(dst, page_address(chunk) + offset, nr * SECTOR_SIZE);
+	}
+	else {
+		data = csl_zpage_get(ppn >> dev->chunk_shift);
+		if(data) memcpy(dst, data + offset, nr * SECTOR_SIZE);
+		else memset(dst, 0, nr * SECTOR_SIZE);
+		csl_zpage_put();
+	}
+	rcu_read_unlock();
+}
+
+/**
+ * csl_read() : Read to request
  * 
  * @ppn : the start sector number
- * @buf : a pointer of buffer to save the data
+ * @it : position in the request to save the data
  * @num_sec : how many sectors to read 
  */
-void csl_read(uint ppn, void* buf, uint num_sec)
+void csl_read(uint ppn, struct csl_rq_iter *it, uint num_sec)
 {
 	uint nbytes = num_sec * SECTOR_SIZE;
 
-	if (ppn >= DEV_SECTOR_NUM){
+	if (ppn >= dev->sector_num){
 		printk(KERN_WARNING "Wrong Sector num!");
+		csl_rq_copy(it, NULL, nbytes, 0);
 		return;	
 	}
 
-	memcpy(buf, dev->data+(ppn*SECTOR_SIZE), nbytes);
+	csl_copy_sectors(ppn, it, num_sec, 0);
 }
 
 /**
- * csl_write() : Write from data
+ * csl_write() : Write from request
  * 
- * @ppn : the start sector number
- * @buf : a pointer of buffer which have the data
- * @num_sec : how many sectors to write
+ * @shard : the shard to allocate sectors from
+ * @it : position in the request which have the data
+ * @num_sec : how many sectors to write, at most CSL_SHARD_STRIPE
+ * 
+ * The sectors are contiguous, so the data goes in with one pass over the request pages.
+ * The tail of the open segment may take only the first csl_alloc_len() of them,
+ * the caller writes the rest with another call.
+ * return : the first sector written, OUT_OF_SECTOR or OUT_OF_MEMORY on failure
  */
-unsigned int csl_write(void* buf, uint num_sec)
+unsigned int csl_write(struct csl_shard *shard, struct csl_rq_iter *it, uint num_sec)
 {
 	uint ppn;
-	uint nbytes = num_sec * SECTOR_SIZE;
+	u64 t = csl_lat_start();
+
+	ppn = find_free_sector(shard, num_sec, 0);
 
-	ppn = find_free_sector(num_sec);
+	/* There is no free sector > Do garbage collection until the write fits */
+	while (ppn >= dev->sector_num){
+		/* GC can not help, let the block layer retry the request later */
+		if(ppn == OUT_OF_MEMORY) return OUT_OF_MEMORY;
 
-	/* There is no free sector > Do garbage collection */
-	if (ppn >= DEV_SECTOR_NUM ){
-		uint ppn_new = csl_gc();
-		if(ppn_new >= DEV_SECTOR_NUM || ppn_new*SECTOR_SIZE + nbytes > DEVICE_TOTAL_SIZE){
-			pr_warn("THERE IS NO CAPACITY IN CSL!");
+		if(csl_gc(shard) < 0){
+			/* GC skips segments which are not restored or backed up yet, retry once they are */
+			if(READ_ONCE(dev->lazy_left) || !bitmap_empty(dev->ckpt_pin, dev->segment_num)) return OUT_OF_MEMORY;
+
+			pr_warn_ratelimited("THERE IS NO CAPACITY IN CSL!");
+			csl_stat_add(CSL_STAT_ALLOC_FAILS, 1);
 			return OUT_OF_SECTOR;
 		}
-		
-		memcpy((void*)dev->data+(ppn_new*SECTOR_SIZE), buf, nbytes);
-		return ppn_new; 
+		ppn = find_free_sector(shard, num_sec, 0);
 	}
+	num_sec = csl_alloc_len(ppn, num_sec);
+	trace_csl_alloc(shard - dev->shards, num_sec, ppn, csl_lat_end(CSL_LAT_ALLOC, t));
 
-	/* There is Free sector */
-	if(ppn >= DEV_SECTOR_NUM || ppn*SECTOR_SIZE + nbytes > DEVICE_TOTAL_SIZE){
-			pr_warn("THERE IS NO CAPACITY IN CSL!");
-			return OUT_OF_SECTOR;
-	}
-	memcpy((void*)dev->data+(ppn*SECTOR_SIZE), buf, nbytes);
+	csl_copy_sectors(ppn, it, num_sec, 1);
+	csl_stat_add(CSL_STAT_HOST_WRITES, num_sec);
+	csl_stat_add(CSL_STAT_MEDIA_WRITES, num_sec);
 
 	return ppn;	
 }
@@ -194,94 +530,402 @@ static int csl_ioctl(struct block_device *bdev, blk_mode_t mode, unsigned cmd, u
 }
 
 /**
- * csl_transfer() : check mapping information
+ * csl_rq_zero_run() : measure the run of sectors at the position in the request which are zeroes, or which are not
+ * 
+ * @it : position in the request, it is not advanced
+ * @num_sec : how many sectors to look at, at most
+ * @zero : set if the run is zeroes
  * 
- * @dev : struct of our device
+ * The block layer aligns request pages to the logical block size, so a sector never spans two of them.
+ * memchr_inv() checks a word at a time and stops at the first byte which is not zero,
+ * so data is usually told from zeroes by its first word.
+ * return : the length of the run
+ */
+static unsigned int csl_rq_zero_run(struct csl_rq_iter *it, unsigned int num_sec, bool *zero)
+{
+	struct csl_rq_iter pos = *it;
+	struct bio_vec bvec;
+	void *buffer;
+	unsigned int run;
+	bool z;
+
+	for(run = 0; run < num_sec; run++){
+		bvec = bio_iter_iovec(pos.bio, pos.iter);
+		buffer = kmap_local_page(bvec.bv_page);
+		z = memchr_inv(buffer + bvec.bv_offset, 0, SECTOR_SIZE) == NULL;
+		kunmap_local(buffer);
+
+		if(run == 0) *zero = z;
+		else if(z != *zero) break;
+
+		csl_rq_copy(&pos, NULL, SECTOR_SIZE, 1);
+	}
+
+	return run;
+}
+
+/**
+ * csl_map_run() : map a run of LBAs and invalidate what they mapped before
+ * 
+ * @shard : the shard which owns lba, caller holds shard->lock
+ * @lba : the first LBA
+ * @nr : how many LBAs
+ * @ppn : the first physical sector the run was written to, CSL_ZERO if it is zeroes
+ * 
+ * return : how many of the LBAs were never written
+ */
+static unsigned int csl_map_run(struct csl_shard *shard, unsigned int lba, unsigned int nr, unsigned int ppn)
+{
+	unsigned int i, ppn_old, inserts = 0;
+
+	write_seqcount_begin(&shard->seq);
+	for(i = 0; i < nr; i++){
+		ppn_old = dev->l2p[lba + i];
+
+		if(ppn == CSL_ZERO){
+			WRITE_ONCE(dev->l2p[lba + i], CSL_ZERO);
+		}
+		else {
+			WRITE_ONCE(dev->l2p[lba + i], ppn + i);
+			dev->p2l[ppn + i] = lba + i;
+		}
+
+		if(csl_l2p_mapped(ppn_old)) csl_invalidate(shard, ppn_old, lba + i);
+		else if(ppn_old == CSL_UNMAPPED) inserts++;
+	}
+	write_seqcount_end(&shard->seq);
+
+	return inserts;
+}
+
+/**
+ * csl_shard_transfer() : check mapping information
+ * 
+ * @shard : the shard which owns start_sec, caller holds shard->lock for a write
  * @start_sec : the start sector number
- * @num_sec : how many sectors we have to read or write
- * @buffer : pointer of memory area we access
+ * @num_sec : how many sectors we have to read or write, within one stripe
+ * @it : position in the request we access
  * @isWrite : the request is read or write
  * 
+ * A write is split in runs of zero sectors and of data. Zero runs are only mapped to CSL_ZERO,
+ * data runs are written contiguously. If a run fails, the runs before it stay mapped
+ * and the position in the request goes back to the start of the piece.
+ * The piece then pays for the GC debt of the shard in proportion to the sectors it allocated.
+ * return : SUCCESS_EXIT, FAIL_EXIT if there is no capacity for a write, -ENOMEM if there is no memory for it
  */
-void csl_transfer(unsigned int start_sec, unsigned int num_sec, void* buffer, int isWrite){
+int csl_shard_transfer(struct csl_shard *shard, unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it, int isWrite){
 
-	struct l2b_item* l2b_item;
-	void* ret;
+	struct csl_rq_iter pos = *it;
 	uint final_ppn;
+	uint i, run, run_inserts, inserts = 0, written = 0;
+	bool zero;
+	int ret = SUCCESS_EXIT;
+	u64 t;
 
 	if(isWrite){
-		ret = xa_load(&dev->l2p_map, (unsigned long)start_sec);
-		
-		/* There is no existing mapping information */
-		if(!ret){
-			final_ppn = csl_write(buffer, num_sec);
-			if(final_ppn > DEV_SECTOR_NUM) return;
-
-			/* Success to write > add new mapping information */	
-			l2b_item = kmalloc(sizeof(struct l2b_item), GFP_KERNEL);
-
-			if(IS_ERR(l2b_item) || l2b_item == NULL){
-				pr_warn(MALLOC_ERROR_MSG);
-				return;
-			}
+		/* Shared sectors are found one by one */
+		if(dev->dd_refs) return csl_dedup_write(shard, start_sec, num_sec, it);
 
-			l2b_item->lba = start_sec;
-			l2b_item->ppn = final_ppn;
+		for(i = 0; i < num_sec; i += run){
+			run = csl_rq_zero_run(it, num_sec - i, &zero);
 
-			xa_store(&dev->l2p_map, l2b_item->lba, (void*)l2b_item, GFP_KERNEL);
+			if(zero){
+				csl_rq_copy(it, NULL, run * SECTOR_SIZE, 1);
+				final_ppn = CSL_ZERO;
+				csl_stat_add(CSL_STAT_HOST_WRITES, run);
+				csl_stat_add(CSL_STAT_ZERO_WRITES, run);
+			}
+			else {
+				/* csl_write() may run GC which remaps sectors, so look up old mappings after it */
+				final_ppn = csl_write(shard, it, run);
+				if(final_ppn == OUT_OF_MEMORY || final_ppn >= dev->sector_num){
+					*it = pos;
+					ret = (final_ppn == OUT_OF_MEMORY) ? -ENOMEM : FAIL_EXIT;
+					break;
+				}
+				/* The rest of a run which filled the tail of a segment is the next run */
+				run = csl_alloc_len(final_ppn, run);
+				written += run;
+			}
+
+			/* Write Success > map the whole run in one pass, invalidate existing ppn */
+			t = csl_lat_start();
+			run_inserts = csl_map_run(shard, start_sec + i, run, final_ppn);
+			trace_csl_map(start_sec + i, run, run_inserts, csl_lat_end(CSL_LAT_MAP, t));
+			inserts += run_inserts;
 		}
 
-		/* There is existing mapping information */
-		else{
-			l2b_item = (struct l2b_item*) ret;
-			
-			unsigned int ppn_old = l2b_item->ppn;
-			final_ppn = csl_write(buffer, num_sec);
-			if(final_ppn > DEV_SECTOR_NUM) return;
-			
-			/* Write Success > Invalidate existing ppn and update mapping information */
-			l2b_item->ppn = final_ppn;
-			csl_invalidate(ppn_old);
+		if(i){
+			csl_stat_add(CSL_STAT_MAP_INSERTS, inserts);
+			csl_stat_add(CSL_STAT_MAP_UPDATES, i - inserts);
+			csl_journal_mark(start_sec, i);
+			csl_backup_mark_l2p(start_sec);
 		}
+
+		/* GC after the whole piece, once old sectors of it are invalid and cost nothing to clean */
+		csl_gc_throttle(shard, written);
 		//pr_info("CSL : write start[%d] | num_sec[%d] | ppn[%d]", start_sec, num_sec, final_ppn);
 	}
 
 	else {
-		ret = xa_load(&dev->l2p_map, start_sec);
-		if(IS_ERR(ret) || ret == NULL) return; // There is no mapping information 
-		l2b_item = (struct l2b_item*) ret;
-		csl_read(l2b_item->ppn, buffer, num_sec);
+		csl_shard_read(shard, start_sec, num_sec, it);
 	}
-	
+
+	return ret;
 }
 
 /**
- * csl_get_request() : get request and split it into bio
+ * csl_shard_lock() : take the lock of a shard for a write
  * 
- * @rq : request we have to split
+ * @shard : the shard to write
+ * @locked : the shard whose lock a batch holds, NULL outside of a batch
  * 
+ * A batch keeps the lock from one write to the next, so writes which land on the same shard
+ * back to back take it once. The caller of the batch drops the last one.
+ * The wait for the lock is what the csl_lock tracepoint and histogram measure.
  */
-void csl_get_request(struct request *rq)
+static void csl_shard_lock(struct csl_shard *shard, struct csl_shard **locked)
+{
+	u64 t;
+
+	if(locked){
+		if(*locked == shard) return;
+		if(*locked) spin_unlock(&(*locked)->lock);
+		*locked = shard;
+	}
+
+	t = csl_lat_start();
+	spin_lock(&shard->lock);
+	trace_csl_lock(shard - dev->shards, csl_lat_end(CSL_LAT_LOCK, t));
+}
+
+/**
+ * csl_shard_copy() : copy sectors of a shard to the request as the L2P table maps them
+ * 
+ * Sectors which are contiguous on both sides are copied with one csl_read().
+ */
+static void csl_shard_copy(unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it)
+{
+	unsigned int i, run;
+	u32 ppn;
+
+	for(i = 0; i < num_sec; i += run){
+		ppn = READ_ONCE(dev->l2p[start_sec + i]);
+
+		if(!csl_l2p_mapped(ppn)){
+			// There is no physical sector > never written, trimmed or zeroes, zero the whole run at once
+			for(run = 1; i + run < num_sec; run++){
+				if(csl_l2p_mapped(READ_ONCE(dev->l2p[start_sec + i + run]))) break;
+			}
+			csl_rq_copy(it, NULL, run * SECTOR_SIZE, 0);
+			continue;
+		}
+
+		for(run = 1; i + run < num_sec; run++){
+			if(READ_ONCE(dev->l2p[start_sec + i + run]) != ppn + run) break;
+		}
+		csl_read(ppn, it, run);
+	}
+}
+
+/**
+ * csl_shard_read() : read without taking the shard lock
+ * 
+ * @shard : the shard which owns start_sec, the caller does not hold its lock
+ * @start_sec : the start sector number
+ * @num_sec : how many sectors we have to read
+ * @it : position in the request to save the data
+ * 
+ * A remap in this shard bumps shard->seq before the old sector can be handed out again,
+ * so if it changed while we copied, the copy may be stale and we retry from the saved position.
+ * Any write of the shard does, so a read which keeps losing the race to a busy shard
+ * takes its lock for the last copy after CSL_READ_RETRIES tries instead of retrying forever.
+ */
+void csl_shard_read(struct csl_shard *shard, unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it)
+{
+	struct csl_rq_iter pos = *it;
+	unsigned int seq;
+	int tries;
+
+	for(tries = 0; tries < CSL_READ_RETRIES; tries++){
+		*it = pos;
+		seq = read_seqcount_begin(&shard->seq);
+		csl_shard_copy(start_sec, num_sec, it);
+		if(!read_seqcount_retry(&shard->seq, seq)) return;
+	}
+
+	*it = pos;
+	csl_shard_lock(shard, NULL);
+	csl_shard_copy(start_sec, num_sec, it);
+	spin_unlock(&shard->lock);
+}
+
+/**
+ * csl_transfer() : split the transfer by shard, writes run under the shard lock
+ * 
+ * @start_sec : the start sector number
+ * @num_sec : how many sectors we have to read or write
+ * @it : position in the request we access
+ * @isWrite : the request is read or write
+ * @locked : the shard whose lock a batch holds, NULL to lock each piece on its own
+ * 
+ * return : SUCCESS_EXIT, or the error of the last piece which failed
+ */
+int csl_transfer(unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it, int isWrite, struct csl_shard **locked){
+
+	struct csl_shard *shard;
+	unsigned int chunk;
+	int ret = SUCCESS_EXIT;
+	int err;
+
+	trace_csl_transfer(start_sec, num_sec, isWrite);
+
+	while(num_sec){
+		/* A piece never crosses the stripe boundary, so it belongs to one shard */
+		chunk = min(num_sec, CSL_SHARD_STRIPE - (start_sec % CSL_SHARD_STRIPE));
+		shard = csl_get_shard(start_sec);
+
+		if(isWrite){
+			csl_shard_lock(shard, locked);
+			err = csl_shard_transfer(shard, start_sec, chunk, it, isWrite);
+			if(err < 0){
+				/* keep the position in step with start_sec */
+				csl_rq_copy(it, NULL, chunk * SECTOR_SIZE, 1);
+				ret = err;
+			}
+			if(locked == NULL) spin_unlock(&shard->lock);
+		}
+		else {
+			/* A read may fall back to the shard lock, the lock of the batch is not kept over it */
+			if(locked && *locked){
+				spin_unlock(&(*locked)->lock);
+				*locked = NULL;
+			}
+			csl_shard_transfer(shard, start_sec, chunk, it, isWrite);
+		}
+
+		start_sec += chunk;
+		num_sec -= chunk;
+	}
+
+	return ret;
+}
+
+/**
+ * csl_discard() : drop the mapping of sectors
+ * 
+ * @start_sec : the start sector number
+ * @num_sec : how many sectors to drop
+ * 
+ * Used for both discard and write zeroes, since an unmapped sector reads as zeroes.
+ * Old sectors are only invalidated, so GC finds them dead instead of migrating them.
+ * Runs in queue_rq, which must not sleep, so a request is at most CSL_MAX_DISCARD_SECTORS
+ * and the shard lock is dropped after every stripe.
+ */
+void csl_discard(unsigned int start_sec, unsigned int num_sec)
+{
+	struct csl_shard *shard;
+	unsigned int chunk, i;
+	u32 ppn_old;
+
+	while(num_sec){
+		chunk = min(num_sec, CSL_SHARD_STRIPE - (start_sec % CSL_SHARD_STRIPE));
+		shard = csl_get_shard(start_sec);
+
+		csl_shard_lock(shard, NULL);
+		write_seqcount_begin(&shard->seq);
+		for(i = 0; i < chunk; i++){
+			ppn_old = dev->l2p[start_sec + i];
+			if(ppn_old == CSL_UNMAPPED) continue;
+
+			WRITE_ONCE(dev->l2p[start_sec + i], CSL_UNMAPPED);
+			if(!csl_l2p_mapped(ppn_old)) continue;
+
+			csl_invalidate(shard, ppn_old, start_sec + i);
+			csl_stat_add(CSL_STAT_TRIMMED, 1);
+		}
+		write_seqcount_end(&shard->seq);
+		csl_journal_mark(start_sec, chunk);
+		csl_backup_mark_l2p(start_sec);
+		spin_unlock(&shard->lock);
+
+		start_sec += chunk;
+		num_sec -= chunk;
+	}
+}
+
+/**
+ * csl_get_request() : run a request
+ * 
+ * @rq : request we have to run
+ * @locked : the shard whose lock a batch holds, NULL outside of a batch
+ * 
+ * The request is walked by shard pieces rather than by bvec, so a merged request of any size
+ * costs one allocation and one mapping update per stripe it touches.
+ * Writing a piece again is harmless, so a request which ran out of memory is simply retried as a whole.
+ */
+blk_status_t csl_get_request(struct request *rq, struct csl_shard **locked)
 {
 	
 	int isWrite = rq_data_dir(rq);
+	int ret;
+
+	struct csl_rq_iter it;
+
+	switch(req_op(rq)){
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		csl_discard(blk_rq_pos(rq), blk_rq_sectors(rq));
+		return BLK_STS_OK;
+	case REQ_OP_FLUSH:
+		/* csl_enqueue() hands it to the journal */
+		return BLK_STS_OK;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
 
-	sector_t start_sector = blk_rq_pos(rq);
-	
-	struct bio_vec bvec;
-	struct req_iterator iter;
+	if(blk_rq_sectors(rq) == 0) return BLK_STS_OK;
 
-	void* buffer;
+	it.bio = rq->bio;
+	it.iter = rq->bio->bi_iter;
+
+	ret = csl_transfer(blk_rq_pos(rq), blk_rq_sectors(rq), &it, isWrite, locked); // transfer로 들어가면 read or write를 실행
+	if(ret == -ENOMEM) return BLK_STS_RESOURCE;
+	if(ret < 0) return BLK_STS_NOSPC;
 
-	rq_for_each_segment(bvec, rq, iter){
-		unsigned int num_sector = blk_rq_cur_sectors(rq); 
+	csl_stat_add(isWrite ? CSL_STAT_WRITES : CSL_STAT_READS, 1);
+	csl_stat_add(isWrite ? CSL_STAT_WRITE_BYTES : CSL_STAT_READ_BYTES, blk_rq_bytes(rq));
 
-		buffer = page_address(bvec.bv_page)+bvec.bv_offset;
+	return BLK_STS_OK;
+}
 
-		csl_transfer(start_sector, num_sector, buffer, isWrite); // transfer로 들어가면 read or write를 실행
+/**
+ * csl_end_request() : complete a request which ran in the submitting context
+ * 
+ * @rq : the request
+ * @status : its status
+ * 
+ * A request of a poll queue is left for csl_poll(), so the poller completes it
+ * without an interrupt or softirq in between.
+ */
+void csl_end_request(struct request *rq, blk_status_t status)
+{
+	struct blk_mq_hw_ctx *hctx = rq->mq_hctx;
+	struct csl_pollq *pq = hctx->driver_data;
 
-		start_sector += num_sector; 
+	if(hctx->type != HCTX_TYPE_POLL){
+		blk_mq_end_request(rq, status);
+		return;
 	}
+
+	((struct csl_cmd *)blk_mq_rq_to_pdu(rq))->status = status;
+
+	spin_lock(&pq->lock);
+	list_add_tail(&rq->queuelist, &pq->rqs);
+	spin_unlock(&pq->lock);
 }
 
 /**
@@ -289,18 +933,135 @@ void csl_get_request(struct request *rq)
  */
 blk_status_t csl_enqueue(struct blk_mq_hw_ctx *ctx, const struct blk_mq_queue_data *data){
 	struct request *rq = data->rq;
+	blk_status_t status;
+	u64 t = csl_lat_start();
 	
 	blk_mq_start_request(rq);
+
+	/* A read of data still in the backup file waits for it in a work item */
+	if(req_op(rq) == REQ_OP_READ && csl_lazy_needed(blk_rq_pos(rq), blk_rq_sectors(rq))){
+		csl_lazy_defer_rq(rq);
+		return BLK_STS_OK;
+	}
 	
-	spin_lock(&csl_lock);
-	csl_get_request(rq);
-	spin_unlock(&csl_lock);
+	/* Locking is done per shard in csl_transfer() */
+	status = csl_get_request(rq, NULL);
+	trace_csl_request(rq, status, csl_lat_end(CSL_LAT_REQUEST, t));
 
-	blk_mq_end_request(rq, BLK_STS_OK);
+	/* The block layer requeues the request and runs the queue again later */
+	if(status == BLK_STS_RESOURCE) return status;
+
+	/* Completed by the journal once the data is on stable storage, it is kicked at the end of the batch */
+	if(status == BLK_STS_OK && (req_op(rq) == REQ_OP_FLUSH || (rq->cmd_flags & REQ_FUA))){
+		csl_journal_sync_rq(rq, data->last);
+		return BLK_STS_OK;
+	}
+
+	csl_end_request(rq, status);
 
 	return BLK_STS_OK;
 }
 
+/**
+ * csl_commit_rqs() : kick the journal when a batch ends before its last request
+ * 
+ * @hctx : the hardware queue
+ * 
+ * The block layer calls it if csl_enqueue() never saw a request with data->last set,
+ * so FLUSH and FUA requests of the batch do not wait for the next one.
+ */
+static void csl_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	csl_journal_kick();
+}
+
+/**
+ * csl_batchable() : check a request can run in a batch of csl_queue_rqs()
+ * 
+ * @rq : the request
+ * 
+ * Reads, writes and flushes only. A trim takes the lock of every shard it touches on its own,
+ * and a read of data still in the backup file waits for it, so they go through csl_enqueue() one by one.
+ */
+static bool csl_batchable(struct request *rq)
+{
+	switch(req_op(rq)){
+	case REQ_OP_READ:
+		return !csl_lazy_needed(blk_rq_pos(rq), blk_rq_sectors(rq));
+	case REQ_OP_WRITE:
+	case REQ_OP_FLUSH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * csl_queue_rqs() : run a plugged batch of requests
+ * 
+ * @rqlist : the batch, requests left in it are sent to csl_enqueue() by the block layer
+ * 
+ * Writes keep the lock of their shard for the next request, so a batch of writes
+ * to one shard takes it once and allocates its sectors back to back.
+ * It is dropped before a read, and between two requests as soon as another CPU waits for it,
+ * so a request of another CPU waits for one request of the batch at most.
+ * Requests are completed once the lock is dropped, FLUSH and FUA ones wake the journal once.
+ * A request which ran out of memory is requeued, like BLK_STS_RESOURCE from csl_enqueue().
+ */
+static void csl_queue_rqs(struct request **rqlist)
+{
+	struct request *single = NULL, *done = NULL, *nospc = NULL, *requeue = NULL;
+	struct csl_shard *locked = NULL;
+	struct request_queue *q = NULL;
+	struct request *rq;
+	blk_status_t status;
+	bool sync = false;
+	u64 t;
+
+	while((rq = rq_list_pop(rqlist))){
+		if(!csl_batchable(rq)){
+			rq_list_add(&single, rq);
+			continue;
+		}
+
+		t = csl_lat_start();
+		blk_mq_start_request(rq);
+		status = csl_get_request(rq, &locked);
+		trace_csl_request(rq, status, csl_lat_end(CSL_LAT_REQUEST, t));
+
+		if(status == BLK_STS_OK) rq_list_add(&done, rq);
+		else if(status == BLK_STS_RESOURCE) rq_list_add(&requeue, rq);
+		else rq_list_add(&nospc, rq);
+
+		if(locked && spin_is_contended(&locked->lock)){
+			spin_unlock(&locked->lock);
+			locked = NULL;
+		}
+	}
+
+	if(locked) spin_unlock(&locked->lock);
+
+	while((rq = rq_list_pop(&done))){
+		if(req_op(rq) == REQ_OP_FLUSH || (rq->cmd_flags & REQ_FUA)){
+			csl_journal_sync_rq(rq, false);
+			sync = true;
+		}
+		else csl_end_request(rq, BLK_STS_OK);
+	}
+	if(sync) csl_journal_kick();
+
+	while((rq = rq_list_pop(&nospc))) csl_end_request(rq, BLK_STS_NOSPC);
+
+	while((rq = rq_list_pop(&requeue))){
+		q = rq->q;
+		blk_mq_requeue_request(rq, false);
+	}
+	if(q) blk_mq_delay_kick_requeue_list(q, CSL_REQUEUE_DELAY);
+
+	/* The order of the rest does not matter, the block layer does not keep one */
+	*rqlist = single;
+}
+
 static struct block_device_operations csl_fops = {
 	.owner = THIS_MODULE,
 	.open = csl_open,
@@ -309,32 +1070,327 @@ static struct block_device_operations csl_fops = {
 };
 
 
+static void csl_complete_batch(struct io_comp_batch *iob)
+{
+	blk_mq_end_request_batch(iob);
+}
+
+/**
+ * csl_poll() : complete the requests which ran on a poll queue
+ * 
+ * @hctx : the poll queue
+ * @iob : the batch of the poller, requests go in it to be completed together
+ * 
+ * The data was copied when the request was queued, so there is nothing to wait for.
+ * return : the number of requests completed
+ */
+static int csl_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct csl_pollq *pq = hctx->driver_data;
+	struct request *rq, *tmp;
+	blk_status_t status;
+	LIST_HEAD(rqs);
+	int nr = 0;
+
+	spin_lock(&pq->lock);
+	list_splice_init(&pq->rqs, &rqs);
+	spin_unlock(&pq->lock);
+
+	list_for_each_entry_safe(rq, tmp, &rqs, queuelist){
+		list_del_init(&rq->queuelist);
+		status = ((struct csl_cmd *)blk_mq_rq_to_pdu(rq))->status;
+
+		if(!blk_mq_add_to_batch(rq, iob, status != BLK_STS_OK, csl_complete_batch))
+			blk_mq_end_request(rq, status);
+		nr++;
+	}
+
+	return nr;
+}
+
+/**
+ * csl_init_hctx() : give a poll queue its completion list
+ * 
+ * @hctx : the hardware queue
+ * @data : tag_set.driver_data, the device
+ * @hctx_idx : index of the queue, poll queues come after the default ones
+ */
+static int csl_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+	struct csl_dev *mydev = data;
+	unsigned int first = mydev->tag_set.nr_hw_queues - mydev->nr_poll_queues;
+
+	if(hctx_idx >= first) hctx->driver_data = &mydev->pollqs[hctx_idx - first];
+
+	return SUCCESS_EXIT;
+}
+
+/**
+ * csl_map_queues() : spread the CPUs over the default and the poll queues
+ * 
+ * @set : the tag set
+ * 
+ * Reads share the default queues, polled I/O of every CPU goes to the poll queues.
+ */
+static void csl_map_queues(struct blk_mq_tag_set *set)
+{
+	struct csl_dev *mydev = set->driver_data;
+	struct blk_mq_queue_map *map;
+	unsigned int offset = 0;
+	int i;
+
+	for(i = 0; i < set->nr_maps; i++){
+		map = &set->map[i];
+
+		if(i == HCTX_TYPE_DEFAULT) map->nr_queues = set->nr_hw_queues - mydev->nr_poll_queues;
+		else if(i == HCTX_TYPE_POLL) map->nr_queues = mydev->nr_poll_queues;
+		else map->nr_queues = 0;
+
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+
+		if(map->nr_queues) blk_mq_map_queues(map);
+	}
+}
+
 static struct blk_mq_ops csl_mq_ops = {
-	.queue_rq = csl_enqueue
+	.queue_rq = csl_enqueue,
+	.queue_rqs = csl_queue_rqs,
+	.commit_rqs = csl_commit_rqs,
+	.poll = csl_poll,
+	.init_hctx = csl_init_hctx,
+	.map_queues = csl_map_queues
 };
 
+/**
+ * csl_free_chunks() : free the data chunks and the chunk table
+ * 
+ * @mydev : the device
+ */
+static void csl_free_chunks(struct csl_dev *mydev)
+{
+	unsigned int i;
+
+	if(mydev->chunks){
+		for(i = 0; i < mydev->nr_chunks; i++){
+			if(mydev->chunks[i]) __free_pages(mydev->chunks[i], mydev->chunk_order);
+		}
+	}
+	kvfree(mydev->chunks);
+	mydev->chunks = NULL;
+}
+
+/**
+ * csl_alloc_chunks() : allocate the chunk table, and all the chunks for huge_backing
+ * 
+ * @mydev : the device, geometry is already set
+ * 
+ * 2MB pages may be short when memory is fragmented, then we fall back to 4KB pages on demand
+ * rather than failing the load.
+ * return : SUCCESS_EXIT, or FAIL_EXIT if the table could not be allocated
+ */
+static int csl_alloc_chunks(struct csl_dev *mydev)
+{
+	unsigned int i;
+
+	if(huge_backing && mydev->sector_num % (PAGE_SECTORS << CSL_HUGE_ORDER) == 0){
+		mydev->chunk_order = CSL_HUGE_ORDER;
+		mydev->chunk_shift = CSL_HUGE_ORDER + PAGE_SECTORS_SHIFT;
+		mydev->nr_chunks = mydev->sector_num >> mydev->chunk_shift;
+
+		mydev->chunks = kvcalloc(mydev->nr_chunks, sizeof(struct page *), GFP_KERNEL);
+		if(!mydev->chunks) return FAIL_EXIT;
+
+		for(i = 0; i < mydev->nr_chunks; i++){
+			mydev->chunks[i] = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, CSL_HUGE_ORDER);
+			if(!mydev->chunks[i]) break;
+		}
+		if(i == mydev->nr_chunks) return SUCCESS_EXIT;
+
+		pr_warn("CSL : only %u of %u huge pages, use 4KB pages", i, mydev->nr_chunks);
+		csl_free_chunks(mydev);
+	}
+	else if(huge_backing){
+		pr_warn("CSL : capacity_mb is not a multiple of huge page, use 4KB pages");
+	}
+
+	mydev->chunk_order = 0;
+	mydev->chunk_shift = PAGE_SECTORS_SHIFT;
+	mydev->nr_chunks = mydev->sector_num >> mydev->chunk_shift;
+
+	mydev->chunks = kvcalloc(mydev->nr_chunks, sizeof(struct page *), GFP_KERNEL);
+	if(!mydev->chunks) return FAIL_EXIT;
+
+	return SUCCESS_EXIT;
+}
+
+/**
+ * csl_free_ftl() : free the memory allocated by csl_alloc_ftl()
+ * 
+ * @mydev : the device, members which were not allocated are NULL
+ */
+static void csl_free_ftl(struct csl_dev *mydev)
+{
+	csl_lazy_exit(mydev);
+	csl_journal_exit(mydev);
+	csl_compress_exit(mydev);
+	csl_dedup_exit(mydev);
+
+	if(mydev->gc_wq) destroy_workqueue(mydev->gc_wq);
+
+	csl_free_chunks(mydev);
+
+	bitmap_free(mydev->free_map);
+	bitmap_free(mydev->valid_map);
+	bitmap_free(mydev->dirty_segs);
+	bitmap_free(mydev->dirty_l2p);
+	bitmap_free(mydev->dirty_oob);
+	bitmap_free(mydev->ckpt_pin);
+	free_percpu(mydev->stats);
+	kvfree(mydev->l2p);
+	kvfree(mydev->p2l);
+	kvfree(mydev->segs);
+}
+
+/**
+ * csl_alloc_ftl() : set the geometry from capacity_mb and allocate the FTL state
+ * 
+ * @mydev : the device
+ * 
+ * Unless huge_backing is set, only the chunk table is allocated for the data, chunks come when a segment is opened.
+ * return : SUCCESS_EXIT, or FAIL_EXIT if the capacity is wrong or memory is short
+ */
+static int csl_alloc_ftl(struct csl_dev *mydev)
+{
+	unsigned int op_segs;
+	int i;
+
+	/* Lazy restore state, it is only used if csl_restore() fills lazy_map */
+	mutex_init(&mydev->lazy_mutex);
+	spin_lock_init(&mydev->lazy_lock);
+	INIT_LIST_HEAD(&mydev->lazy_rqs);
+	INIT_WORK(&mydev->lazy_work, csl_lazy_work);
+
+	if(capacity_mb < CSL_MIN_CAPACITY_MB || capacity_mb > CSL_MAX_CAPACITY_MB){
+		pr_warn("CSL : capacity_mb must be between %d and %d", CSL_MIN_CAPACITY_MB, CSL_MAX_CAPACITY_MB);
+		return FAIL_EXIT;
+	}
+
+	/* Every MB is one segment of every shard */
+	mydev->shard_segment_num = capacity_mb * (1024 * 1024 / SIZE_OF_SECTOR) / CSL_SEGMENT_SECTORS / CSL_NR_SHARDS;
+	mydev->shard_sector_num = mydev->shard_segment_num * CSL_SEGMENT_SECTORS;
+	mydev->segment_num = mydev->shard_segment_num * CSL_NR_SHARDS;
+	mydev->sector_num = mydev->shard_sector_num * CSL_NR_SHARDS;
+
+	op_segs = max(CSL_OP_SEGMENTS, mydev->shard_segment_num * CSL_OP_PERCENT / 100);
+	mydev->lba_num = (mydev->shard_segment_num - op_segs) * CSL_SEGMENT_SECTORS * CSL_NR_SHARDS;
+
+	/* Allocate chunks and bitmap for the data */
+	csl_alloc_chunks(mydev);
+	mydev->free_map = bitmap_zalloc(mydev->sector_num, GFP_KERNEL);
+
+	/* Allocate background GC workqueue */
+	mydev->gc_wq = alloc_workqueue("csl_gc", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+
+	/* Allocate segment state, every segment starts free */
+	mydev->segs = kvcalloc(mydev->segment_num, sizeof(struct csl_segment), GFP_KERNEL);
+
+	/* Allocate flat L2P table, one entry per logical sector */
+	mydev->l2p = kvmalloc_array(mydev->lba_num, sizeof(u32), GFP_KERNEL);
+
+	/* Allocate reverse map and valid sector bitmap, one entry per physical sector */
+	mydev->p2l = kvmalloc_array(mydev->sector_num, sizeof(u32), GFP_KERNEL);
+	mydev->valid_map = bitmap_zalloc(mydev->sector_num, GFP_KERNEL);
+
+	/* Allocate dirty bitmaps of the incremental backup */
+	mydev->dirty_segs = bitmap_zalloc(mydev->segment_num, GFP_KERNEL);
+	mydev->dirty_l2p = bitmap_zalloc(DIV_ROUND_UP(mydev->lba_num, CSL_L2P_BLOCK), GFP_KERNEL);
+	mydev->dirty_oob = bitmap_zalloc(mydev->segment_num, GFP_KERNEL);
+	mydev->ckpt_pin = bitmap_zalloc(mydev->segment_num, GFP_KERNEL);
+
+	/* Allocate counters, zeroed */
+	mydev->stats = alloc_percpu(struct csl_stats);
+
+	if(!mydev->chunks || !mydev->free_map || !mydev->gc_wq || !mydev->segs || !mydev->l2p || !mydev->p2l || !mydev->valid_map
+		|| !mydev->dirty_segs || !mydev->dirty_l2p || !mydev->dirty_oob || !mydev->ckpt_pin || !mydev->stats){
+		pr_warn(MALLOC_ERROR_MSG);
+		csl_free_ftl(mydev);
+		return FAIL_EXIT;
+	}
+	memset(mydev->l2p, 0xff, mydev->lba_num * sizeof(u32)); // CSL_UNMAPPED
+
+	/* Set compression up, closed segments are compressed once the device is restored */
+	if(csl_compress_init(mydev) < 0){
+		csl_free_ftl(mydev);
+		return FAIL_EXIT;
+	}
+
+	/* Allocate dedup state, the index fills up as sectors are written */
+	if(csl_dedup_init(mydev, false) < 0){
+		csl_free_ftl(mydev);
+		return FAIL_EXIT;
+	}
+
+	/* Allocate journal, it is replayed after the backup is restored */
+	if(csl_journal_init(mydev) < 0){
+		csl_free_ftl(mydev);
+		return FAIL_EXIT;
+	}
+
+	/* init shards before the disk can receive any request */
+	for(i = 0; i < CSL_NR_SHARDS; i++){
+		struct csl_shard *shard = &mydev->shards[i];
+
+		spin_lock_init(&shard->lock);
+		seqcount_spinlock_init(&shard->seq, &shard->lock);
+		shard->base = i * mydev->shard_sector_num;
+		INIT_WORK(&shard->gc_work, csl_gc_work);
+	}
+
+	return SUCCESS_EXIT;
+}
+
 static struct csl_dev *csl_alloc(void)
 {
 	struct csl_dev *mydev;
 	struct gendisk *disk;
 
 	int error;
+	int i;
 
 	/* Allocate device information space */
 	mydev = kzalloc(sizeof(struct csl_dev), GFP_KERNEL);
+	if(!mydev) return NULL;
+
+	/* Poll queues keep their completed requests until they are polled */
+	mydev->nr_poll_queues = min(poll_queues, nr_cpu_ids);
+	if(mydev->nr_poll_queues){
+		mydev->pollqs = kcalloc(mydev->nr_poll_queues, sizeof(struct csl_pollq), GFP_KERNEL);
+		if(!mydev->pollqs){
+			kfree(mydev);
+			return NULL;
+		}
+
+		for(i = 0; i < mydev->nr_poll_queues; i++){
+			spin_lock_init(&mydev->pollqs[i].lock);
+			INIT_LIST_HEAD(&mydev->pollqs[i].rqs);
+		}
+	}
 
 	/* Allocate tag set*/
 	mydev->tag_set.ops = &csl_mq_ops;
-	mydev->tag_set.nr_hw_queues = 1;
-	mydev->tag_set.queue_depth = 128;
+	mydev->tag_set.nr_hw_queues = nr_cpu_ids + mydev->nr_poll_queues; // one hardware queue per cpu, then the poll queues
+	mydev->tag_set.nr_maps = mydev->nr_poll_queues ? HCTX_MAX_TYPES : 1;
+	mydev->tag_set.queue_depth = QUEUE_LIMIT;
 	mydev->tag_set.numa_node = NUMA_NO_NODE;
-	mydev->tag_set.cmd_size = 0;
+	mydev->tag_set.cmd_size = sizeof(struct csl_cmd);
 	mydev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
 	mydev->tag_set.driver_data = mydev;
 
 	error = blk_mq_alloc_tag_set(&mydev->tag_set);
 
 	if(error){
+		kfree(mydev->pollqs);
 		kfree(mydev);
 		return NULL;
 	}
@@ -343,6 +1399,13 @@ static struct csl_dev *csl_alloc(void)
 	/* Allocate disk */
 	
 	disk = blk_mq_alloc_disk(&mydev->tag_set, &queue_limit, mydev->queue);
+
+	if(IS_ERR(disk)){
+		blk_mq_free_tag_set(&mydev->tag_set);
+		kfree(mydev->pollqs);
+		kfree(mydev);
+		return NULL;
+	}
 	
 	disk->major = CSL_MAJOR;
 	disk->fops = &csl_fops;
@@ -352,31 +1415,49 @@ static struct csl_dev *csl_alloc(void)
 
 	snprintf(disk->disk_name, 32, "CSL");
 
-	if(IS_ERR(disk)){
+	mydev->gdisk = disk;
+	mydev->queue = disk->queue;
+
+	/* Writes are volatile until a FLUSH or FUA request commits the journal */
+	blk_queue_write_cache(mydev->queue, true, true);
+
+	/* Allocate the FTL for capacity_mb */
+	if(csl_alloc_ftl(mydev) < 0){
+		put_disk(disk);
 		blk_mq_free_tag_set(&mydev->tag_set);
+		kfree(mydev->pollqs);
 		kfree(mydev);
 		return NULL;
 	}
 
-	mydev->gdisk = disk;
-	mydev->queue = disk->queue;
+	/* requests can arrive as soon as add_disk() is called */
+	dev = mydev;
+	csl_init_segments();
 
-	error = add_disk(disk); 
+	error = device_add_disk(NULL, disk, csl_attr_groups); 
 	if(error){
+		csl_free_ftl(mydev);
+		put_disk(disk);
 		blk_mq_free_tag_set(&mydev->tag_set);
+		dev = NULL;
+		kfree(mydev->pollqs);
 		kfree(mydev);
 		return NULL;
 	}
-	set_capacity(mydev->gdisk, DEV_SECTOR_NUM);
+	set_capacity(mydev->gdisk, mydev->lba_num);
 
-	/* Allocate bitmap and Actual data space */
-	mydev->data = vmalloc(DEVICE_TOTAL_SIZE);
-	mydev->free_map = bitmap_alloc(DEV_SECTOR_NUM, GFP_KERNEL);
+	return mydev;
+}
 
-	/* init lock*/
-	spin_lock_init(&mydev->csl_lock);
+static void csl_free(void)
+{
+	blk_mq_destroy_queue(dev->queue);
+	unregister_blkdev(CSL_MAJOR,DEV_NAME);
+	blk_mq_free_tag_set(&dev->tag_set);
+	kfree(dev->pollqs);
 
-	return mydev;
+	csl_free_ftl(dev);
+	return;
 }
 
 static int __init csl_init(void)
@@ -409,32 +1490,42 @@ static int __init csl_init(void)
 	
 	dev = mydev;
 
-	/* Get Backup data */
-	csl_restore(dev);
+	/* Get Backup data, then the changes made after it */
+	result = csl_restore(dev);
+	if(result < 0){
+		/* Leave the backup files alone, rather than start without some of the mappings */
+		del_gendisk(dev->gdisk);
+		put_disk(dev->gdisk);
+		csl_free();
+		kfree(dev);
+		dev = NULL;
+		return result;
+	}
+	csl_journal_replay();
+
+	/* Backups are taken and closed segments compressed in the background from now on */
+	csl_ckpt_start();
+	csl_compress_all();
+	csl_debugfs_init();
 	
-	printk(KERN_INFO "DEVICE : CSL is successfully initialized with major number %d, SECTOR NUM : %d, free_sector = %ld\n",CSL_MAJOR,DEV_SECTOR_NUM, FREE_MAP_SIZE);
+	printk(KERN_INFO "DEVICE : CSL is successfully initialized with major number %d, SECTOR NUM : %d, free_sector = %ld, chunk = %lu KB\n",CSL_MAJOR,dev->sector_num, FREE_MAP_SIZE(dev->sector_num), PAGE_SIZE << dev->chunk_order >> 10);
 	return 0;
 }
 
 
-static void csl_free(void)
-{
-	blk_mq_destroy_queue(dev->queue);
-	xa_destroy(&dev->l2p_map);
-	unregister_blkdev(CSL_MAJOR,DEV_NAME);
-	blk_mq_free_tag_set(&dev->tag_set);
-
-	struct list_head *e, *tmp;
-	list_for_each_safe(e, tmp, &dev->list){
-		list_del(e);
-		kfree(list_entry(e, struct list_item, list_head));
-	}
-	return;
-}
 static void __exit csl_exit(void)
 {
-	csl_backup(dev);
+	/* No more background backup, request and background GC before the state is saved */
+	csl_ckpt_stop();
+	csl_debugfs_exit();
 	del_gendisk(dev->gdisk);
+	flush_workqueue(dev->journal.wq);
+	destroy_workqueue(dev->gc_wq);
+	dev->gc_wq = NULL;
+
+	csl_report_waf();
+	display_index();
+	if(csl_checkpoint(false) < 0) pr_warn(BACKUP_FAIL_MSG);
 	put_disk(dev->gdisk);
 
 	csl_free();
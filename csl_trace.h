@@ -0,0 +1,155 @@
+/*
+* Tracepoints of the request pipeline, under events/csl in tracefs.
+*
+* Every event carries the time spent in its stage in ns. Time is only taken while one of them
+* is enabled or latency_hist is set, see csl_lat_start().
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM csl
+
+#if !defined(_CSL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CSL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blk-mq.h>
+
+int csl_trace_reg(void);
+void csl_trace_unreg(void);
+
+TRACE_EVENT_FN(csl_request,
+	TP_PROTO(struct request *rq, blk_status_t status, u64 ns),
+	TP_ARGS(rq, status, ns),
+	TP_STRUCT__entry(
+		__field(u64, lba)
+		__field(u32, nr)
+		__field(u32, op)
+		__field(int, status)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->lba = blk_rq_pos(rq);
+		__entry->nr = blk_rq_sectors(rq);
+		__entry->op = req_op(rq);
+		__entry->status = blk_status_to_errno(status);
+		__entry->ns = ns;
+	),
+	TP_printk("lba=%llu nr=%u op=%u status=%d ns=%llu",
+		__entry->lba, __entry->nr, __entry->op, __entry->status, __entry->ns),
+	csl_trace_reg, csl_trace_unreg
+);
+
+TRACE_EVENT_FN(csl_lock,
+	TP_PROTO(unsigned int shard, u64 ns),
+	TP_ARGS(shard, ns),
+	TP_STRUCT__entry(
+		__field(u32, shard)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->shard = shard;
+		__entry->ns = ns;
+	),
+	TP_printk("shard=%u wait_ns=%llu", __entry->shard, __entry->ns),
+	csl_trace_reg, csl_trace_unreg
+);
+
+TRACE_EVENT(csl_transfer,
+	TP_PROTO(unsigned int start_sec, unsigned int num_sec, int isWrite),
+	TP_ARGS(start_sec, num_sec, isWrite),
+	TP_STRUCT__entry(
+		__field(u32, start_sec)
+		__field(u32, num_sec)
+		__field(int, write)
+	),
+	TP_fast_assign(
+		__entry->start_sec = start_sec;
+		__entry->num_sec = num_sec;
+		__entry->write = isWrite;
+	),
+	TP_printk("lba=%u nr=%u %s", __entry->start_sec, __entry->num_sec, __entry->write ? "write" : "read")
+);
+
+TRACE_EVENT_FN(csl_map,
+	TP_PROTO(unsigned int start_sec, unsigned int num_sec, unsigned int inserts, u64 ns),
+	TP_ARGS(start_sec, num_sec, inserts, ns),
+	TP_STRUCT__entry(
+		__field(u32, start_sec)
+		__field(u32, num_sec)
+		__field(u32, inserts)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->start_sec = start_sec;
+		__entry->num_sec = num_sec;
+		__entry->inserts = inserts;
+		__entry->ns = ns;
+	),
+	TP_printk("lba=%u nr=%u inserts=%u ns=%llu",
+		__entry->start_sec, __entry->num_sec, __entry->inserts, __entry->ns),
+	csl_trace_reg, csl_trace_unreg
+);
+
+TRACE_EVENT_FN(csl_alloc,
+	TP_PROTO(unsigned int shard, unsigned int size, unsigned int ppn, u64 ns),
+	TP_ARGS(shard, size, ppn, ns),
+	TP_STRUCT__entry(
+		__field(u32, shard)
+		__field(u32, size)
+		__field(u32, ppn)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->shard = shard;
+		__entry->size = size;
+		__entry->ppn = ppn;
+		__entry->ns = ns;
+	),
+	TP_printk("shard=%u size=%u ppn=%u ns=%llu", __entry->shard, __entry->size, __entry->ppn, __entry->ns),
+	csl_trace_reg, csl_trace_unreg
+);
+
+TRACE_EVENT_FN(csl_gc_step,
+	TP_PROTO(unsigned int shard, unsigned int victim, int moved, u64 ns),
+	TP_ARGS(shard, victim, moved, ns),
+	TP_STRUCT__entry(
+		__field(u32, shard)
+		__field(u32, victim)
+		__field(int, moved)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->shard = shard;
+		__entry->victim = victim;
+		__entry->moved = moved;
+		__entry->ns = ns;
+	),
+	TP_printk("shard=%u victim=%u moved=%d ns=%llu", __entry->shard, __entry->victim, __entry->moved, __entry->ns),
+	csl_trace_reg, csl_trace_unreg
+);
+
+TRACE_EVENT_FN(csl_copy,
+	TP_PROTO(unsigned int ppn, unsigned int num_sec, int isWrite, u64 ns),
+	TP_ARGS(ppn, num_sec, isWrite, ns),
+	TP_STRUCT__entry(
+		__field(u32, ppn)
+		__field(u32, num_sec)
+		__field(int, write)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->ppn = ppn;
+		__entry->num_sec = num_sec;
+		__entry->write = isWrite;
+		__entry->ns = ns;
+	),
+	TP_printk("ppn=%u nr=%u %s ns=%llu", __entry->ppn, __entry->num_sec, __entry->write ? "write" : "read", __entry->ns),
+	csl_trace_reg, csl_trace_unreg
+);
+
+#endif /* _CSL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE csl_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,265 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/xxhash.h>
+
+#include "csl.h"
+
+static bool dedup = false;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "write a sector whose data is already on the device once, and point every LBA of it at one physical sector");
+
+/*
+* csl_dedup_init() : allocate the reference counts, the LBA chains and the hash index
+* @dev : the device, its geometry is set
+* @force : set them up even if the dedup parameter is off, for a restored mapping which shares sectors
+*
+* return : SUCCESS_EXIT, also if dedup stays off, FAIL_EXIT if memory is short
+*/
+int csl_dedup_init(struct csl_dev *dev, bool force)
+{
+	if(!dedup && !force) return SUCCESS_EXIT;
+	if(dev->dd_refs) return SUCCESS_EXIT;
+
+	/* One bucket per physical sector of the shard, rounded down so a mask picks it */
+	dev->dd_bits = ilog2(dev->shard_sector_num);
+
+	dev->dd_refs = kvcalloc(dev->sector_num, sizeof(u16), GFP_KERNEL);
+	dev->dd_next = kvmalloc_array(dev->lba_num, sizeof(u32), GFP_KERNEL);
+	dev->dd_prev = kvmalloc_array(dev->lba_num, sizeof(u32), GFP_KERNEL);
+	dev->dd_index = kvmalloc_array(CSL_NR_SHARDS << dev->dd_bits, sizeof(struct csl_dd_entry), GFP_KERNEL);
+	dev->dd_bucket = kvmalloc_array(dev->sector_num, sizeof(u32), GFP_KERNEL);
+	dev->dd_buf = kmalloc_array(CSL_NR_SHARDS, 2 * SECTOR_SIZE, GFP_KERNEL);
+	if(!dev->dd_refs || !dev->dd_next || !dev->dd_prev || !dev->dd_index || !dev->dd_bucket || !dev->dd_buf){
+		pr_warn(MALLOC_ERROR_MSG);
+		csl_dedup_exit(dev);
+		return FAIL_EXIT;
+	}
+
+	memset(dev->dd_next, 0xff, dev->lba_num * sizeof(u32)); // CSL_UNMAPPED
+	memset(dev->dd_prev, 0xff, dev->lba_num * sizeof(u32));
+	memset(dev->dd_index, 0xff, (CSL_NR_SHARDS << dev->dd_bits) * sizeof(struct csl_dd_entry));
+	memset(dev->dd_bucket, 0xff, dev->sector_num * sizeof(u32));
+
+	pr_info("CSL : DEDUP WITH %u BUCKETS PER SHARD", 1U << dev->dd_bits);
+	return SUCCESS_EXIT;
+}
+
+void csl_dedup_exit(struct csl_dev *dev)
+{
+	kvfree(dev->dd_refs);
+	dev->dd_refs = NULL;
+	kvfree(dev->dd_next);
+	dev->dd_next = NULL;
+	kvfree(dev->dd_prev);
+	dev->dd_prev = NULL;
+	kvfree(dev->dd_index);
+	dev->dd_index = NULL;
+	kvfree(dev->dd_bucket);
+	dev->dd_bucket = NULL;
+	kfree(dev->dd_buf);
+	dev->dd_buf = NULL;
+}
+
+/*
+* csl_dedup_entry() : get the bucket of a hash in the index of a shard
+*/
+static struct csl_dd_entry *csl_dedup_entry(struct csl_shard *shard, u64 hash)
+{
+	return &dev->dd_index[((shard - dev->shards) << dev->dd_bits) + (hash & ((1U << dev->dd_bits) - 1))];
+}
+
+/*
+* csl_dedup_match() : check the sector a bucket points at holds the same data
+* @e : the bucket
+* @hash : the hash of the data
+* @buf : the data, followed by room for one sector to compare with
+*
+* A bucket is not cleaned when its sector dies, and two hashes may share it,
+* so the tag, the valid bit and the data itself are checked.
+* return : the physical sector, CSL_UNMAPPED if there is none with this data
+*/
+static unsigned int csl_dedup_match(struct csl_dd_entry *e, u64 hash, u8 *buf)
+{
+	unsigned int ppn = e->ppn;
+
+	if(ppn == CSL_UNMAPPED || e->tag != upper_32_bits(hash)) return CSL_UNMAPPED;
+	if(!test_bit(ppn, dev->valid_map) || dev->dd_refs[ppn] == U16_MAX) return CSL_UNMAPPED;
+
+	/* The sector may be compressed */
+	csl_copy_out(ppn, buf + SECTOR_SIZE, 1);
+	if(memcmp(buf, buf + SECTOR_SIZE, SECTOR_SIZE)) return CSL_UNMAPPED;
+
+	return ppn;
+}
+
+/*
+* csl_dedup_unref() : take an LBA off the sectors it shares
+* @ppn : the physical sector the LBA maps
+* @lba : the LBA
+*
+* Called under the shard lock, inside its seqcount. The chain is linked both ways, so this is O(1)
+* however many LBAs share the sector. The head of the chain is the tag of the sector,
+* so the tag moves on to the next LBA if the head leaves.
+* return : true if other LBAs still map the sector, it must not be invalidated
+*/
+bool csl_dedup_unref(unsigned int ppn, unsigned int lba)
+{
+	u32 prev = dev->dd_prev[lba];
+	u32 next = dev->dd_next[lba];
+
+	if(prev == CSL_UNMAPPED) dev->p2l[ppn] = next;
+	else dev->dd_next[prev] = next;
+	if(next != CSL_UNMAPPED) dev->dd_prev[next] = prev;
+
+	dev->dd_next[lba] = CSL_UNMAPPED;
+	dev->dd_prev[lba] = CSL_UNMAPPED;
+
+	if(dev->dd_refs[ppn] > 1){
+		dev->dd_refs[ppn]--;
+		csl_backup_mark_oob(ppn / CSL_SEGMENT_SECTORS);
+		return true;
+	}
+
+	dev->dd_refs[ppn] = 0;
+	return false;
+}
+
+/*
+* csl_dedup_link() : add an LBA to the chain of a physical sector
+*
+* Called under the shard lock, inside its seqcount, after the old mapping of the LBA was dropped.
+* The LBA becomes the head of the chain.
+*/
+void csl_dedup_link(unsigned int ppn, unsigned int lba)
+{
+	u32 head = dev->dd_refs[ppn] ? dev->p2l[ppn] : CSL_UNMAPPED;
+
+	dev->dd_next[lba] = head;
+	dev->dd_prev[lba] = CSL_UNMAPPED;
+	if(head != CSL_UNMAPPED) dev->dd_prev[head] = lba;
+	dev->p2l[ppn] = lba;
+	dev->dd_refs[ppn]++;
+}
+
+/*
+* csl_dedup_write() : write sectors one by one, the ones already on the device are only mapped
+* @shard : the shard which owns start_sec, caller holds shard->lock
+* @start_sec : the start sector number
+* @num_sec : how many sectors, within one stripe
+* @it : position in the request which has the data
+*
+* A sector of zeroes is mapped to CSL_ZERO. Any other one is hashed with xxh64
+* and looked up in the index of its shard before it is allocated.
+* On a hit, the LBA joins the chain of the physical sector and nothing is written.
+* On a failure the position in the request is put back to the start of the piece, as the caller expects.
+* The GC debt of the shard is paid once for the sectors the piece allocated, as csl_shard_transfer() does.
+* return : SUCCESS_EXIT, FAIL_EXIT if there is no capacity, -ENOMEM if there is no memory
+*/
+int csl_dedup_write(struct csl_shard *shard, unsigned int start_sec, unsigned int num_sec, struct csl_rq_iter *it)
+{
+	u8 *buf = dev->dd_buf + (shard - dev->shards) * 2 * SECTOR_SIZE;
+	struct csl_rq_iter pos = *it, peek;
+	struct csl_dd_entry *e;
+	unsigned int i, lba, ppn, ppn_old;
+	unsigned int inserts = 0, lookups = 0, hits = 0, written = 0;
+	int ret = SUCCESS_EXIT;
+	u64 hash;
+
+	for(i = 0; i < num_sec; i++){
+		lba = start_sec + i;
+
+		/* Look at the data without moving past it, csl_write() takes it from the request */
+		peek = *it;
+		csl_rq_copy(&peek, buf, SECTOR_SIZE, 1);
+
+		/* Zeroes get no sector, they are neither looked up nor indexed */
+		if(memchr_inv(buf, 0, SECTOR_SIZE) == NULL){
+			*it = peek;
+			ppn = CSL_ZERO;
+			csl_stat_add(CSL_STAT_HOST_WRITES, 1);
+			csl_stat_add(CSL_STAT_ZERO_WRITES, 1);
+		}
+		else {
+			hash = xxh64(buf, SECTOR_SIZE, 0);
+			e = csl_dedup_entry(shard, hash);
+			lookups++;
+
+			ppn = csl_dedup_match(e, hash, buf);
+			if(ppn != CSL_UNMAPPED){
+				*it = peek;
+				hits++;
+				csl_stat_add(CSL_STAT_HOST_WRITES, 1);
+				csl_backup_mark_oob(ppn / CSL_SEGMENT_SECTORS);
+			}
+			else {
+				/* csl_write() may run GC which remaps sectors, so look up the old mapping after it */
+				ppn = csl_write(shard, it, 1);
+				if(ppn == OUT_OF_MEMORY || ppn >= dev->sector_num){
+					*it = pos;
+					ret = (ppn == OUT_OF_MEMORY) ? -ENOMEM : FAIL_EXIT;
+					break;
+				}
+
+				written++;
+				e->ppn = ppn;
+				e->tag = upper_32_bits(hash);
+				dev->dd_bucket[ppn] = e - dev->dd_index;
+			}
+		}
+
+		/* The same data written again to the same LBA */
+		ppn_old = dev->l2p[lba];
+		if(ppn_old == ppn) continue;
+
+		write_seqcount_begin(&shard->seq);
+		if(csl_l2p_mapped(ppn_old)) csl_invalidate(shard, ppn_old, lba);
+		else if(ppn_old == CSL_UNMAPPED) inserts++;
+
+		WRITE_ONCE(dev->l2p[lba], ppn);
+		if(ppn != CSL_ZERO) csl_dedup_link(ppn, lba);
+		write_seqcount_end(&shard->seq);
+	}
+
+	/* Sectors mapped before a failure stay mapped, the retry writes them again */
+	csl_stat_add(CSL_STAT_DD_LOOKUPS, lookups);
+	csl_stat_add(CSL_STAT_DD_HITS, hits);
+	csl_stat_add(CSL_STAT_MAP_INSERTS, inserts);
+	csl_stat_add(CSL_STAT_MAP_UPDATES, i - inserts);
+	if(i){
+		csl_journal_mark(start_sec, i);
+		csl_backup_mark_l2p(start_sec);
+	}
+	csl_gc_throttle(shard, written);
+
+	return ret;
+}
+
+/*
+* csl_dedup_move() : move the other LBAs of a sector GC migrated
+* @ppn : the old physical sector
+* @ppn_new : the new one, the head of the chain is already mapped to it
+*
+* Called under the shard lock, inside its seqcount. The bucket which pointed at the old sector
+* points at the new one, so the data is still found. It is known from dd_bucket, the data is not hashed again.
+*/
+void csl_dedup_move(unsigned int ppn, unsigned int ppn_new)
+{
+	u32 bucket = dev->dd_bucket[ppn];
+	u32 lba;
+
+	for(lba = dev->dd_next[dev->p2l[ppn_new]]; lba != CSL_UNMAPPED; lba = dev->dd_next[lba]){
+		WRITE_ONCE(dev->l2p[lba], ppn_new);
+		csl_backup_mark_l2p(lba);
+	}
+
+	dev->dd_refs[ppn_new] = dev->dd_refs[ppn];
+	dev->dd_refs[ppn] = 0;
+
+	dev->dd_bucket[ppn_new] = bucket;
+	dev->dd_bucket[ppn] = CSL_UNMAPPED;
+	if(bucket != CSL_UNMAPPED && dev->dd_index[bucket].ppn == ppn) dev->dd_index[bucket].ppn = ppn_new;
+}
@@ -0,0 +1,50 @@
+RUNTIME=30s
+IO_DEPTH=32
+CAPACITY_MB=2048
+SIZE=1g
+RAMP=5s
+IOENGINE=io_uring
+DIRECT=1
+VERIFY=0
+FILE_NAME="/dev/CSL"
+MODULE="../csl.ko"
+
+# Compare 4KB page backing with 2MB huge page backing on randread over 1GB
+BACKING=("0" "1")
+BLOCK_SIZES=("512B" "4k")
+NUM_JOBS=("1" "4" "16")
+
+run_fio_test(){
+	local bs=$1
+	local output_file=$2
+	local rwtype=$3
+	local num_jobs=$4
+
+	sudo fio --filename=$FILE_NAME --name=fio_test --size=$SIZE --time_based --runtime=$RUNTIME --ramp_time=$RAMP \
+		--ioengine=$IOENGINE --direct=$DIRECT --verify=$VERIFY --bs=$bs --iodepth=$IO_DEPTH \
+		--rw=$rwtype --numjobs=$num_jobs --output-format=csv --output=$output_file
+}
+
+mkdir -p ./result
+
+for huge in "${BACKING[@]}"; do
+	sudo rmmod csl 2>/dev/null
+	# a fresh device, drop every backup slot, delta and journal file of the last run
+	sudo rm -f /dev/csl_backup /dev/csl_backup.1 /dev/csl_backup_delta /dev/csl_journal /dev/csl_journal.1
+	sudo insmod $MODULE capacity_mb=$CAPACITY_MB huge_backing=$huge
+
+	# fill the device first, so every read hits the backing memory
+	sudo fio --filename=$FILE_NAME --name=fill --size=$SIZE --bs=128k --rw=write --ioengine=$IOENGINE --direct=$DIRECT --iodepth=$IO_DEPTH
+
+	for bs in "${BLOCK_SIZES[@]}"; do
+		for num_jobs in "${NUM_JOBS[@]}"; do
+			output_file="./result/fio_huge${huge}_${bs}_randread_job${num_jobs}.csv"
+			echo "Running fio randread with huge_backing $huge, blk size $bs and jobs $num_jobs"
+			run_fio_test $bs $output_file randread $num_jobs
+		done
+	done
+done
+
+sudo rmmod csl
+
+echo "FIO TEST COMPLETE"
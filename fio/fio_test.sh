@@ -9,7 +9,7 @@ FILE_NAME="/dev/CSL"
 
 TYPE=("write" "read" "randread" "randwrite")
 BLOCK_SIZES=("512B")
-NUM_JOBS=("4")
+NUM_JOBS=("1" "2" "4" "8" "16")
 
 run_fio_test(){
 	local bs=$1
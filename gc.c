@@ -0,0 +1,236 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+
+#include "csl.h"
+#include "csl_trace.h"
+
+static int gc_policy = CSL_GC_GREEDY;
+module_param(gc_policy, int, 0644);
+MODULE_PARM_DESC(gc_policy, "GC victim selection, 0 : greedy, 1 : cost-benefit");
+
+static int gc_low_wm = CSL_GC_LOW_WM;
+module_param(gc_low_wm, int, 0644);
+MODULE_PARM_DESC(gc_low_wm, "free segments per shard below which background GC starts");
+
+static int gc_high_wm = CSL_GC_HIGH_WM;
+module_param(gc_high_wm, int, 0644);
+MODULE_PARM_DESC(gc_high_wm, "free segments per shard at which background GC stops");
+
+/*
+* csl_gc_score() : how much we want to clean a segment, higher is better
+* @shard : the shard which owns the segment
+* @seg : a closed segment
+*
+* Greedy only looks at the reclaimable sectors.
+* Cost-benefit weighs them by age as (1 - u) * age / (1 + u), so cold segments are cleaned
+* before their last sectors are invalidated.
+*/
+static u64 csl_gc_score(struct csl_shard *shard, struct csl_segment *seg)
+{
+	u64 reclaim = CSL_SEGMENT_SECTORS - seg->valid;
+
+	if(gc_policy == CSL_GC_COST_BENEFIT)
+		return div_u64(reclaim * (shard->clock - seg->mtime + 1), CSL_SEGMENT_SECTORS + seg->valid);
+
+	return reclaim;
+}
+
+/*
+* csl_select_victim() : find the segment to clean
+* @shard : the shard to clean, caller holds shard->lock
+*
+* Only closed segments which have something to reclaim are candidates,
+* their data must be restored already and no checkpoint may still have to write them.
+* The caller makes sure no victim is being cleaned already.
+*/
+static struct csl_segment *csl_select_victim(struct csl_shard *shard)
+{
+	struct csl_segment *seg;
+	struct csl_segment *victim = NULL;
+	unsigned int first = shard->base / CSL_SEGMENT_SECTORS;
+	u64 score, best = 0;
+	int i;
+
+	for(i = 0; i < dev->shard_segment_num; i++){
+		seg = &dev->segs[first + i];
+
+		if(seg == shard->open || seg->wp == 0 || seg->valid == CSL_SEGMENT_SECTORS) continue;
+		if(csl_seg_lazy(first + i) || csl_seg_pinned(first + i)) continue;
+
+		score = csl_gc_score(shard, seg);
+		if(score > best){
+			best = score;
+			victim = seg;
+		}
+	}
+
+	return victim;
+}
+
+/*
+* csl_release_segment() : give an empty segment back to the free list
+* @shard : the shard which owns the segment
+* @seg : the segment, it must not have any valid sector
+*/
+static void csl_release_segment(struct csl_shard *shard, struct csl_segment *seg)
+{
+	bitmap_clear(dev->free_map, csl_seg_to_ppn(seg), CSL_SEGMENT_SECTORS);
+	csl_backup_mark_seg(seg - dev->segs);
+	csl_compress_release(seg - dev->segs);
+	seg->wp = 0;
+	csl_stat_add(CSL_STAT_GC_RECLAIMED, CSL_SEGMENT_SECTORS);
+
+	/* Reuse it first, it is still hot in the cache */
+	list_add(&seg->list, &shard->free_segs);
+	shard->nr_free_segs++;
+}
+
+/*
+* csl_gc_step() : Operate Garbage Collection for a bounded number of sectors
+* @shard : the shard to clean, caller holds shard->lock
+* @budget : how many valid sectors of the victim to move
+*
+* Pick a victim if there is none, then move up to budget of its valid sectors to the append point.
+* Once every sector was looked at, the whole segment is freed. A segment pinned by a checkpoint
+* is kept until the checkpoint wrote it, then it is picked again with nothing left to move.
+* return : the number of sectors moved, FAIL_EXIT if there is nothing to clean or no room to migrate
+*/
+int csl_gc_step(struct csl_shard *shard, unsigned int budget)
+{
+	struct csl_segment *victim = shard->gc_victim;
+	unsigned int start, ppn, ppn_new, lba;
+	int done = 0;
+	u64 t = csl_lat_start();
+
+	if(victim == NULL){
+		victim = csl_select_victim(shard);
+		if(victim == NULL) return FAIL_EXIT;
+
+		shard->gc_victim = victim;
+		shard->gc_cursor = 0;
+	}
+	csl_stat_add(CSL_STAT_GC_CALLS, 1);
+
+	start = csl_seg_to_ppn(victim);
+
+	while(done < budget){
+		/* Invalid sectors are skipped a word at a time */
+		ppn = find_next_bit(dev->valid_map, start + victim->wp, start + shard->gc_cursor);
+		if(ppn >= start + victim->wp){
+			shard->gc_cursor = victim->wp;
+			break;
+		}
+		lba = dev->p2l[ppn];
+
+		ppn_new = find_free_sector(shard, 1, 1);
+		if(ppn_new >= dev->sector_num){
+			done = FAIL_EXIT;
+			goto out;
+		}
+
+		csl_copy_out(ppn, csl_sector_addr(ppn_new), 1);
+
+		write_seqcount_begin(&shard->seq);
+		WRITE_ONCE(dev->l2p[lba], ppn_new);
+		dev->p2l[ppn_new] = lba;
+		if(dev->dd_refs) csl_dedup_move(ppn, ppn_new);
+		csl_invalidate(shard, ppn, CSL_UNMAPPED);
+		write_seqcount_end(&shard->seq);
+		csl_backup_mark_l2p(lba);
+
+		csl_stat_add(CSL_STAT_MEDIA_WRITES, 1);
+		csl_stat_add(CSL_STAT_GC_WRITES, 1);
+		shard->gc_cursor = ppn - start + 1;
+		done++;
+	}
+
+	if(shard->gc_cursor == victim->wp){
+		shard->gc_victim = NULL;
+		if(!csl_seg_pinned(victim - dev->segs)) csl_release_segment(shard, victim);
+	}
+
+out:
+	trace_csl_gc_step(shard - dev->shards, victim - dev->segs, done, csl_lat_end(CSL_LAT_GC, t));
+	return done;
+}
+
+/*
+* csl_gc() : Operate Garbage Collection until one segment is cleaned
+* @shard : the shard to clean, caller holds shard->lock
+*
+* The segment is freed unless a checkpoint pinned it meanwhile.
+* return : SUCCESS_EXIT if a segment was cleaned, FAIL_EXIT if there was nothing to clean
+*/
+int csl_gc(struct csl_shard *shard)
+{
+	do {
+		if(csl_gc_step(shard, CSL_SEGMENT_SECTORS) < 0) return FAIL_EXIT;
+	} while(shard->gc_victim != NULL);
+
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_gc_throttle() : make a host write pay for the GC debt of its shard
+* @shard : the shard written, caller holds shard->lock
+* @num_sec : how many sectors the piece of the request allocated
+*
+* Called once per piece of a request. Nothing happens while the shard has gc_low_wm free segments or more.
+* Below it the background GC is kicked, and the writer itself cleans
+* CSL_GC_STEP sectors for every missing free segment and every stripe it wrote, so a nearly full shard
+* slows its writers down gradually instead of stalling one of them for a whole segment.
+*/
+void csl_gc_throttle(struct csl_shard *shard, unsigned int num_sec)
+{
+	int low = max(gc_low_wm, CSL_GC_RESERVE + 1);
+
+	if(num_sec == 0 || shard->nr_free_segs >= low) return;
+
+	queue_work(dev->gc_wq, &shard->gc_work);
+	csl_gc_step(shard, DIV_ROUND_UP((low - shard->nr_free_segs) * CSL_GC_STEP * num_sec, CSL_SHARD_STRIPE));
+}
+
+/*
+* csl_gc_work() : background GC of a shard
+* @work : shard->gc_work
+*
+* Clean until the shard has gc_high_wm free segments. The shard lock is dropped
+* every CSL_GC_STEP sectors so foreground writes are not blocked for a whole segment.
+*/
+void csl_gc_work(struct work_struct *work)
+{
+	struct csl_shard *shard = container_of(work, struct csl_shard, gc_work);
+	int high = max(gc_high_wm, gc_low_wm);
+	int loop = dev->shard_segment_num * (CSL_SEGMENT_SECTORS / CSL_GC_STEP);
+
+	spin_lock(&shard->lock);
+	while(shard->nr_free_segs < high && loop--){
+		if(csl_gc_step(shard, CSL_GC_STEP) < 0) break;
+
+		spin_unlock(&shard->lock);
+		cond_resched();
+		spin_lock(&shard->lock);
+	}
+	spin_unlock(&shard->lock);
+}
+
+/*
+* csl_report_waf() : print the write amplification of the device
+*
+* WAF = media writes / host writes, host writes of zeroes or of data dedup found on the device
+* write nothing, so it drops below 1.00 when they outweigh GC
+*/
+void csl_report_waf(void)
+{
+	u64 host = csl_stat_sum(CSL_STAT_HOST_WRITES);
+	u64 gc = csl_stat_sum(CSL_STAT_GC_WRITES);
+	u64 waf;
+
+	waf = host ? div64_u64(csl_stat_sum(CSL_STAT_MEDIA_WRITES) * 100, host) : 100;
+
+	pr_info("CSL : HOST WRITE %llu sectors, GC WRITE %llu sectors, WAF %llu.%02llu", host, gc, waf / 100, waf % 100);
+	pr_info("CSL : ZERO WRITE %llu sectors, TRIMMED %llu sectors", csl_stat_sum(CSL_STAT_ZERO_WRITES), csl_stat_sum(CSL_STAT_TRIMMED));
+}
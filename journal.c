@@ -0,0 +1,563 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/jiffies.h>
+#include <linux/crc32.h>
+#include <linux/moduleparam.h>
+
+#include "csl.h"
+
+static unsigned int journal_mb = CSL_JOURNAL_DEFAULT_MB;
+module_param(journal_mb, uint, 0644);
+MODULE_PARM_DESC(journal_mb, "journal size in MB at which a new backup is taken");
+
+static unsigned int ckpt_interval = CSL_CKPT_INTERVAL;
+module_param(ckpt_interval, uint, 0644);
+MODULE_PARM_DESC(ckpt_interval, "seconds between background backups if something changed, 0 to take them only when the journal is full");
+
+static unsigned int ckpt_rate_mb = CSL_CKPT_RATE_MB;
+module_param(ckpt_rate_mb, uint, 0644);
+MODULE_PARM_DESC(ckpt_rate_mb, "MB per second written by a background backup, 0 for no limit");
+
+static const char *csl_journal_path[2] = { JOURNAL_FILE_PATH, JOURNAL_FILE_PATH ".1" };
+
+/*
+* csl_journal_crc() : checksum of a record
+* @rec : the header, its crc field is not covered
+* @data : the data of the record, only for CSL_JOURNAL_DATA
+*/
+static u32 csl_journal_crc(struct csl_journal_rec *rec, void *data)
+{
+	struct csl_journal_rec tmp = *rec;
+	u32 crc;
+
+	tmp.crc = 0;
+	crc = crc32_le(~0, (u8 *)&tmp, sizeof(tmp));
+	if(rec->type == CSL_JOURNAL_DATA) crc = crc32_le(crc, data, rec->nr * SECTOR_SIZE);
+
+	return crc;
+}
+
+/*
+* csl_journal_io() : read or write LBAs through the FTL with the journal buffer
+* @lba : the start sector number
+* @nr : how many sectors, at most CSL_JOURNAL_SECTORS
+* @isWrite : write the buffer to the LBAs if set, read them to the buffer if not
+*
+* The buffer is wrapped in a bio on the stack, so the request path does the work
+* with the same locking as any host I/O.
+* return : SUCCESS_EXIT, or the error of csl_transfer()
+*/
+static int csl_journal_io(unsigned int lba, unsigned int nr, int isWrite)
+{
+	struct csl_journal *j = &dev->journal;
+	struct csl_rq_iter it;
+	struct bio_vec bvec;
+	struct bio bio;
+
+	bio_init(&bio, NULL, &bvec, 1, isWrite ? REQ_OP_WRITE : REQ_OP_READ);
+	__bio_add_page(&bio, virt_to_page(j->buf), nr * SECTOR_SIZE, 0);
+
+	it.bio = &bio;
+	it.iter = bio.bi_iter;
+
+	return csl_transfer(lba, nr, &it, isWrite, NULL);
+}
+
+/*
+* csl_journal_start() : start an empty journal file
+* @idx : the file
+* @epoch : the epoch of its records
+*
+* return : the position of the first record, or FAIL_EXIT
+*/
+static loff_t csl_journal_start(unsigned int idx, u32 epoch)
+{
+	struct file *file = dev->journal.file[idx];
+	u32 header[2] = { CSL_JOURNAL_MAGIC, epoch };
+	loff_t pos = 0;
+
+	vfs_truncate(&file->f_path, 0);
+
+	if(kernel_write(file, header, sizeof(header), &pos) != sizeof(header)){
+		pr_warn(FILE_WRITE_ERROR_MSG);
+		return FAIL_EXIT;
+	}
+	if(vfs_fsync(file, 0) < 0) return FAIL_EXIT;
+
+	return pos;
+}
+
+/*
+* csl_journal_mark() : remember LBAs which changed since the last commit
+* @lba : the start sector number
+* @nr : how many sectors, within one stripe
+*
+* Caller holds the lock of the shard which owns the stripe.
+*/
+void csl_journal_mark(unsigned int lba, unsigned int nr)
+{
+	struct csl_journal *j = &dev->journal;
+
+	bitmap_set(j->dirty_map, lba, nr);
+	set_bit(lba / CSL_SHARD_STRIPE, j->dirty_stripes);
+}
+
+/*
+* csl_journal_append() : append the current content of LBAs to the journal
+* @lba : the start sector number
+* @nr : how many sectors, at most CSL_JOURNAL_SECTORS
+* @type : CSL_JOURNAL_DATA, or CSL_JOURNAL_TRIM if they are unmapped
+*
+* A failed append is cut off, so the next one starts where this one did.
+*/
+static int csl_journal_append(unsigned int lba, unsigned int nr, u32 type)
+{
+	struct csl_journal *j = &dev->journal;
+	struct csl_journal_rec rec = {
+		.magic = CSL_JOURNAL_MAGIC,
+		.epoch = j->epoch,
+		.lba = lba,
+		.nr = nr,
+		.type = type,
+	};
+	loff_t pos = j->pos;
+	size_t len = nr * SECTOR_SIZE;
+
+	if(type == CSL_JOURNAL_DATA){
+		if(csl_lazy_load_lbas(lba, nr) < 0) return FAIL_EXIT;
+		csl_journal_io(lba, nr, 0);
+	}
+	rec.crc = csl_journal_crc(&rec, j->buf);
+
+	if(kernel_write(j->file[j->cur], &rec, sizeof(rec), &pos) != sizeof(rec))
+		goto fail;
+	if(type == CSL_JOURNAL_DATA && kernel_write(j->file[j->cur], j->buf, len, &pos) != len)
+		goto fail;
+
+	j->pos = pos;
+	return SUCCESS_EXIT;
+
+fail:
+	pr_warn(FILE_WRITE_ERROR_MSG);
+	return FAIL_EXIT;
+}
+
+/*
+* csl_journal_commit() : make every change done so far durable
+*
+* The dirty bits of a stripe are taken under its shard lock, then the current content
+* of each dirty run is appended. A write racing with us marks its LBAs again for the next commit.
+* Caller holds journal->mutex.
+*/
+static int csl_journal_commit(void)
+{
+	struct csl_journal *j = &dev->journal;
+	unsigned long snap[BITS_TO_LONGS(CSL_SHARD_STRIPE)];
+	unsigned int nr_stripes = dev->lba_num / CSL_SHARD_STRIPE;
+	unsigned int stripe, start, i, nr;
+	struct csl_shard *shard;
+	int appended = 0;
+	u32 type;
+
+	for_each_set_bit(stripe, j->dirty_stripes, nr_stripes){
+		if(!test_and_clear_bit(stripe, j->dirty_stripes)) continue;
+
+		start = stripe * CSL_SHARD_STRIPE;
+		shard = csl_get_shard(start);
+
+		spin_lock(&shard->lock);
+		bitmap_copy(snap, j->dirty_map + BIT_WORD(start), CSL_SHARD_STRIPE);
+		bitmap_zero(j->dirty_map + BIT_WORD(start), CSL_SHARD_STRIPE);
+		spin_unlock(&shard->lock);
+
+		/* Runs of mapped sectors carry data, runs of unmapped or zero ones are trims, both read as zeroes */
+		for(i = find_first_bit(snap, CSL_SHARD_STRIPE); i < CSL_SHARD_STRIPE; i = find_next_bit(snap, CSL_SHARD_STRIPE, i + nr)){
+			type = csl_l2p_mapped(READ_ONCE(dev->l2p[start + i])) ? CSL_JOURNAL_DATA : CSL_JOURNAL_TRIM;
+
+			for(nr = 1; i + nr < CSL_SHARD_STRIPE && test_bit(i + nr, snap); nr++){
+				if(csl_l2p_mapped(READ_ONCE(dev->l2p[start + i + nr])) != (type == CSL_JOURNAL_DATA)) break;
+			}
+
+			if(csl_journal_append(start + i, nr, type) < 0){
+				/* Keep the stripe dirty, it is logged again by the next commit */
+				spin_lock(&shard->lock);
+				bitmap_or(j->dirty_map + BIT_WORD(start), j->dirty_map + BIT_WORD(start), snap, CSL_SHARD_STRIPE);
+				set_bit(stripe, j->dirty_stripes);
+				spin_unlock(&shard->lock);
+				return FAIL_EXIT;
+			}
+			appended++;
+		}
+	}
+
+	if(appended && vfs_fsync(j->file[j->cur], 1) < 0) return FAIL_EXIT;
+
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_journal_sync_rq() : complete a FLUSH or FUA request after the next commit
+* @rq : the request, its data is already in the device
+* @kick : start the commit now, a batch kicks once after its last request otherwise
+*/
+void csl_journal_sync_rq(struct request *rq, bool kick)
+{
+	struct csl_journal *j = &dev->journal;
+
+	spin_lock(&j->lock);
+	list_add_tail(&rq->queuelist, &j->rqs);
+	spin_unlock(&j->lock);
+
+	if(kick) csl_journal_kick();
+}
+
+/*
+* csl_journal_kick() : start a commit for the waiting FLUSH and FUA requests
+*/
+void csl_journal_kick(void)
+{
+	struct csl_journal *j = &dev->journal;
+
+	if(!list_empty_careful(&j->rqs)) queue_work(j->wq, &j->work);
+}
+
+/*
+* csl_journal_work() : commit and complete the waiting FLUSH and FUA requests
+* @work : journal->work
+*
+* One commit serves every request queued before it started.
+*/
+void csl_journal_work(struct work_struct *work)
+{
+	struct csl_journal *j = container_of(work, struct csl_journal, work);
+	blk_status_t status = BLK_STS_OK;
+	struct request *rq, *tmp;
+	LIST_HEAD(rqs);
+
+	spin_lock(&j->lock);
+	list_splice_init(&j->rqs, &rqs);
+	spin_unlock(&j->lock);
+
+	mutex_lock(&j->mutex);
+	if(csl_journal_commit() < 0) status = BLK_STS_IOERR;
+	mutex_unlock(&j->mutex);
+
+	list_for_each_entry_safe(rq, tmp, &rqs, queuelist){
+		list_del_init(&rq->queuelist);
+		blk_mq_end_request(rq, status);
+	}
+
+	if(j->pos > (loff_t)journal_mb << 20) wake_up(&j->ckpt_wait);
+}
+
+/*
+* csl_checkpoint() : take a backup and start the journal of its epoch
+* @online : requests and GC may run, false if the device is quiesced already
+*
+* Online, the mapping is copied and the journal switches to the other file with the next epoch
+* under journal->mutex, then the backup is written at ckpt_rate_mb while requests go on.
+* Until it is complete, the old backup with both journals is what a restore finds.
+* Dirty LBAs are not cleared, a commit of the next epoch logs them again which does no harm.
+*
+* That needs the old epoch to be backed up, since the other file is its journal. After a backup
+* which failed, or a replay of two journals, the queue is frozen and the backup is written
+* before the journal is started again, as it is when the device is quiesced.
+* return : SUCCESS_EXIT, or FAIL_EXIT if no backup was taken
+*/
+int csl_checkpoint(bool online)
+{
+	struct csl_journal *j = &dev->journal;
+	bool quiesce = !online || j->ckpt_epoch != j->epoch;
+	u32 epoch = j->epoch + 1;
+	struct csl_ckpt *ckpt;
+	loff_t pos = 0;
+	int ret;
+
+	/* Only a checkpoint touches the other file, so it is started before anything else */
+	if(!quiesce){
+		pos = csl_journal_start(!j->cur, epoch);
+		if(pos < 0) return FAIL_EXIT;
+	}
+
+	ckpt = csl_backup_begin(dev, quiesce ? 0 : ckpt_rate_mb);
+	if(ckpt == NULL) return FAIL_EXIT;
+	ckpt->epoch = epoch;
+
+	if(!quiesce){
+		mutex_lock(&j->mutex);
+		csl_backup_snapshot(dev, ckpt);
+		j->cur = !j->cur;
+		j->epoch = epoch;
+		j->pos = pos;
+		mutex_unlock(&j->mutex);
+
+		ret = csl_backup_write(dev, ckpt);
+		if(ret == SUCCESS_EXIT) j->ckpt_epoch = epoch;
+		return ret;
+	}
+
+	/* Waiting FLUSH requests are completed by journal->work meanwhile, which does not need the queue */
+	if(online){
+		blk_mq_freeze_queue(dev->queue);
+		flush_workqueue(dev->gc_wq);
+	}
+
+	mutex_lock(&j->mutex);
+	csl_backup_snapshot(dev, ckpt);
+	ret = csl_backup_write(dev, ckpt);
+
+	if(ret == SUCCESS_EXIT){
+		/* Everything is in the backup now */
+		bitmap_zero(j->dirty_map, dev->lba_num);
+		bitmap_zero(j->dirty_stripes, dev->lba_num / CSL_SHARD_STRIPE);
+
+		j->epoch = epoch;
+		j->ckpt_epoch = epoch;
+		pos = csl_journal_start(j->cur, epoch);
+		if(pos < 0) ret = FAIL_EXIT;
+		else j->pos = pos;
+	}
+	mutex_unlock(&j->mutex);
+
+	if(online) blk_mq_unfreeze_queue(dev->queue);
+
+	return ret;
+}
+
+/*
+* csl_ckpt_due() : check the checkpoint thread has something to do
+* @last : jiffies of the last checkpoint
+*/
+static bool csl_ckpt_due(unsigned long last)
+{
+	struct csl_journal *j = &dev->journal;
+
+	if(j->pos > (loff_t)journal_mb << 20) return true;
+
+	return ckpt_interval && time_after_eq(jiffies, last + ckpt_interval * HZ) && csl_backup_dirty(dev);
+}
+
+/*
+* csl_ckpt_thread() : take a backup every ckpt_interval seconds, or when the journal is full
+* @data : unused
+*
+* The tunables may change at any time, so they are looked at again every second.
+* A checkpoint which failed is retried a second later.
+*/
+static int csl_ckpt_thread(void *data)
+{
+	struct csl_journal *j = &dev->journal;
+	unsigned long last = jiffies;
+
+	while(!kthread_should_stop()){
+		wait_event_interruptible_timeout(j->ckpt_wait, kthread_should_stop() || csl_ckpt_due(last), HZ);
+		if(kthread_should_stop() || !csl_ckpt_due(last)) continue;
+
+		if(csl_checkpoint(true) < 0){
+			pr_warn(BACKUP_FAIL_MSG);
+			schedule_timeout_interruptible(HZ);
+		}
+		last = jiffies;
+	}
+
+	return 0;
+}
+
+/*
+* csl_ckpt_start() : start the checkpoint thread, once the journal is replayed
+*/
+int csl_ckpt_start(void)
+{
+	struct task_struct *thread;
+
+	thread = kthread_run(csl_ckpt_thread, NULL, "csl_ckpt");
+	if(IS_ERR(thread)){
+		pr_warn("CSL : FAIL TO START CHECKPOINT THREAD");
+		return FAIL_EXIT;
+	}
+
+	dev->journal.ckpt_thread = thread;
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_ckpt_stop() : stop the checkpoint thread, a backup being written is finished first
+*/
+void csl_ckpt_stop(void)
+{
+	struct csl_journal *j = &dev->journal;
+
+	if(j->ckpt_thread) kthread_stop(j->ckpt_thread);
+	j->ckpt_thread = NULL;
+}
+
+/*
+* csl_journal_replay_file() : apply the records of a journal file
+* @idx : the file
+* @epoch : the epoch it must be of
+*
+* Records are applied through the FTL in order until the first one which is torn,
+* of another epoch or out of range. The next record goes where that one is.
+* return : the number of records applied, or FAIL_EXIT if the file is of another epoch
+*/
+static int csl_journal_replay_file(unsigned int idx, u32 epoch)
+{
+	struct csl_journal *j = &dev->journal;
+	struct file *file = j->file[idx];
+	struct csl_journal_rec rec;
+	int nr_rec = 0;
+	u32 header[2];
+	loff_t pos = 0;
+	int ret, retry;
+
+	if(kernel_read(file, header, sizeof(header), &pos) != sizeof(header)
+		|| header[0] != CSL_JOURNAL_MAGIC || header[1] != epoch){
+		return FAIL_EXIT;
+	}
+	j->pos = pos;
+
+	while(kernel_read(file, &rec, sizeof(rec), &pos) == sizeof(rec)){
+		if(rec.magic != CSL_JOURNAL_MAGIC || rec.epoch != epoch) break;
+		if(rec.type > CSL_JOURNAL_TRIM || rec.nr == 0 || rec.nr > CSL_JOURNAL_SECTORS) break;
+		if(rec.lba >= dev->lba_num || rec.nr > dev->lba_num - rec.lba) break;
+
+		if(rec.type == CSL_JOURNAL_DATA && kernel_read(file, j->buf, rec.nr * SECTOR_SIZE, &pos) != rec.nr * SECTOR_SIZE) break;
+		if(csl_journal_crc(&rec, j->buf) != rec.crc) break;
+
+		if(rec.type == CSL_JOURNAL_DATA){
+			/* Backing pages are allocated without sleeping, give the allocator some time */
+			ret = csl_journal_io(rec.lba, rec.nr, 1);
+			for(retry = 0; ret == -ENOMEM && retry < 100; retry++){
+				msleep(10);
+				ret = csl_journal_io(rec.lba, rec.nr, 1);
+			}
+			if(ret < 0){
+				pr_warn("CSL : FAIL TO REPLAY JOURNAL AT LBA %u", rec.lba);
+				break;
+			}
+		}
+		else {
+			csl_discard(rec.lba, rec.nr);
+		}
+
+		j->pos = pos;
+		nr_rec++;
+	}
+
+	return nr_rec;
+}
+
+/*
+* csl_journal_replay() : apply the journals of the restored backup
+*
+* The journal of the backup epoch goes first, then the one of the next epoch if a checkpoint
+* was writing its backup when we stopped. The last file replayed takes the next records.
+* Journals of any other epoch are thrown away, and file 0 starts empty if none matched.
+*/
+void csl_journal_replay(void)
+{
+	struct csl_journal *j = &dev->journal;
+	int nr, nr_rec = 0;
+	unsigned int i, idx;
+	loff_t pos;
+
+	/* csl_restore() left the epoch of the backup */
+	j->ckpt_epoch = j->epoch;
+
+	for(i = 0; i < 2; i++){
+		for(idx = 0; idx < 2; idx++){
+			nr = csl_journal_replay_file(idx, j->ckpt_epoch + i);
+			if(nr >= 0) break;
+		}
+		if(idx == 2) break;
+
+		j->cur = idx;
+		j->epoch = j->ckpt_epoch + i;
+		nr_rec += nr;
+	}
+
+	if(i == 0){
+		j->cur = 0;
+		pos = csl_journal_start(0, j->epoch);
+		if(pos >= 0) j->pos = pos;
+	}
+
+	/* What we replayed is in the journal already */
+	bitmap_zero(j->dirty_map, dev->lba_num);
+	bitmap_zero(j->dirty_stripes, dev->lba_num / CSL_SHARD_STRIPE);
+
+	pr_info("CSL : REPLAYED %d JOURNAL RECORDS OF %u EPOCH", nr_rec, i);
+}
+
+/*
+* csl_journal_init() : allocate the journal and open its file
+* @dev : the device, its geometry is already set
+*
+* return : SUCCESS_EXIT, or FAIL_EXIT after undoing what was done
+*/
+int csl_journal_init(struct csl_dev *dev)
+{
+	struct csl_journal *j = &dev->journal;
+	int i;
+
+	mutex_init(&j->mutex);
+	spin_lock_init(&j->lock);
+	INIT_LIST_HEAD(&j->rqs);
+	INIT_WORK(&j->work, csl_journal_work);
+	init_waitqueue_head(&j->ckpt_wait);
+
+	j->dirty_map = bitmap_zalloc(dev->lba_num, GFP_KERNEL);
+	j->dirty_stripes = bitmap_zalloc(dev->lba_num / CSL_SHARD_STRIPE, GFP_KERNEL);
+	j->buf = (void *)__get_free_pages(GFP_KERNEL, get_order(CSL_JOURNAL_SECTORS * SECTOR_SIZE));
+	j->wq = alloc_workqueue("csl_journal", WQ_UNBOUND | WQ_MEM_RECLAIM, 2);
+
+	if(!j->dirty_map || !j->dirty_stripes || !j->buf || !j->wq){
+		pr_warn(MALLOC_ERROR_MSG);
+		csl_journal_exit(dev);
+		return FAIL_EXIT;
+	}
+
+	for(i = 0; i < 2; i++){
+		j->file[i] = filp_open(csl_journal_path[i], O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+		if(IS_ERR(j->file[i])){
+			pr_warn(FILE_OPEN_ERROR_MSG);
+			j->file[i] = NULL;
+			csl_journal_exit(dev);
+			return FAIL_EXIT;
+		}
+	}
+
+	return SUCCESS_EXIT;
+}
+
+/*
+* csl_journal_exit() : free the journal
+* @dev : the device, members which were not allocated are NULL
+*/
+void csl_journal_exit(struct csl_dev *dev)
+{
+	struct csl_journal *j = &dev->journal;
+
+	if(j->ckpt_thread) kthread_stop(j->ckpt_thread);
+	if(j->wq) destroy_workqueue(j->wq);
+	if(j->file[0]) filp_close(j->file[0], NULL);
+	if(j->file[1]) filp_close(j->file[1], NULL);
+	if(j->buf) free_pages((unsigned long)j->buf, get_order(CSL_JOURNAL_SECTORS * SECTOR_SIZE));
+
+	bitmap_free(j->dirty_map);
+	bitmap_free(j->dirty_stripes);
+
+	j->ckpt_thread = NULL;
+	j->wq = NULL;
+	j->file[0] = NULL;
+	j->file[1] = NULL;
+	j->buf = NULL;
+	j->dirty_map = NULL;
+	j->dirty_stripes = NULL;
+}
@@ -0,0 +1,267 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#include "csl.h"
+
+#define CREATE_TRACE_POINTS
+#include "csl_trace.h"
+
+static bool latency_hist = false;
+module_param(latency_hist, bool, 0644);
+MODULE_PARM_DESC(latency_hist, "count the time of every pipeline stage in log2 histograms, in debugfs csl/latency");
+
+/* Enabled timed tracepoints, they need the time as much as the histograms do */
+static atomic_t csl_trace_users = ATOMIC_INIT(0);
+
+static struct dentry *csl_debugfs;
+
+static const char *csl_lat_names[CSL_NR_LAT] = {
+	[CSL_LAT_LOCK] = "lock",
+	[CSL_LAT_MAP] = "map",
+	[CSL_LAT_ALLOC] = "alloc",
+	[CSL_LAT_COPY] = "copy",
+	[CSL_LAT_GC] = "gc",
+	[CSL_LAT_REQUEST] = "request",
+};
+
+/* A counter shown as /sys/block/CSL/csl/<name> */
+struct csl_stat_attr{
+	struct device_attribute attr;
+	enum csl_stat idx;
+};
+
+/*
+* csl_stat_sum() : read a counter
+* @idx : the counter
+*
+* The CPUs keep counting meanwhile, so the sum is a snapshot and not exact.
+*/
+u64 csl_stat_sum(enum csl_stat idx)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) sum += per_cpu_ptr(dev->stats, cpu)->v[idx];
+
+	return sum;
+}
+
+static ssize_t csl_stat_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct csl_stat_attr *sa = container_of(attr, struct csl_stat_attr, attr);
+
+	return sysfs_emit(buf, "%llu\n", csl_stat_sum(sa->idx));
+}
+
+/*
+* csl_waf_show() : write amplification, media writes over host writes with two decimals
+*
+* Host writes of zeroes, or which dedup finds on the device, are not written, so it may drop below 1.00.
+*/
+static ssize_t csl_waf_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	u64 host = csl_stat_sum(CSL_STAT_HOST_WRITES);
+	u64 waf = host ? div64_u64(csl_stat_sum(CSL_STAT_MEDIA_WRITES) * 100, host) : 100;
+
+	return sysfs_emit(buf, "%llu.%02llu\n", waf / 100, waf % 100);
+}
+
+/*
+* csl_compr_ratio_show() : size of the pages the compressor went over, over what they take after it
+*/
+static ssize_t csl_compr_ratio_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	u64 bytes = csl_stat_sum(CSL_STAT_CZ_BYTES);
+	u64 ratio = bytes ? div64_u64(csl_stat_sum(CSL_STAT_CZ_PAGES) * PAGE_SIZE * 100, bytes) : 100;
+
+	return sysfs_emit(buf, "%llu.%02llu\n", ratio / 100, ratio % 100);
+}
+
+/*
+* csl_compr_cost_show() : CPU time of the compressor for every GiB it went over, in ns
+*/
+static ssize_t csl_compr_cost_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	u64 in = csl_stat_sum(CSL_STAT_CZ_PAGES) * PAGE_SIZE;
+
+	return sysfs_emit(buf, "%llu\n", in ? mul_u64_u64_div_u64(csl_stat_sum(CSL_STAT_CZ_NS), 1ULL << 30, in) : 0);
+}
+
+/*
+* csl_dedup_rate_show() : percentage of the sectors looked up in the dedup index which were found, with two decimals
+*/
+static ssize_t csl_dedup_rate_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	u64 lookups = csl_stat_sum(CSL_STAT_DD_LOOKUPS);
+	u64 rate = lookups ? div64_u64(csl_stat_sum(CSL_STAT_DD_HITS) * 10000, lookups) : 0;
+
+	return sysfs_emit(buf, "%llu.%02llu\n", rate / 100, rate % 100);
+}
+
+#define CSL_STAT_ATTR(_name, _idx) \
+	static struct csl_stat_attr csl_stat_##_name = { \
+		.attr = __ATTR(_name, 0444, csl_stat_show, NULL), \
+		.idx = _idx, \
+	}
+
+CSL_STAT_ATTR(reads, CSL_STAT_READS);
+CSL_STAT_ATTR(writes, CSL_STAT_WRITES);
+CSL_STAT_ATTR(read_bytes, CSL_STAT_READ_BYTES);
+CSL_STAT_ATTR(write_bytes, CSL_STAT_WRITE_BYTES);
+CSL_STAT_ATTR(map_inserts, CSL_STAT_MAP_INSERTS);
+CSL_STAT_ATTR(map_updates, CSL_STAT_MAP_UPDATES);
+CSL_STAT_ATTR(invalidates, CSL_STAT_INVALIDATES);
+CSL_STAT_ATTR(trimmed, CSL_STAT_TRIMMED);
+CSL_STAT_ATTR(gc_calls, CSL_STAT_GC_CALLS);
+CSL_STAT_ATTR(gc_reclaimed, CSL_STAT_GC_RECLAIMED);
+CSL_STAT_ATTR(alloc_fails, CSL_STAT_ALLOC_FAILS);
+CSL_STAT_ATTR(host_writes, CSL_STAT_HOST_WRITES);
+CSL_STAT_ATTR(zero_writes, CSL_STAT_ZERO_WRITES);
+CSL_STAT_ATTR(media_writes, CSL_STAT_MEDIA_WRITES);
+CSL_STAT_ATTR(gc_writes, CSL_STAT_GC_WRITES);
+CSL_STAT_ATTR(compr_pages, CSL_STAT_CZ_PAGES);
+CSL_STAT_ATTR(compr_bytes, CSL_STAT_CZ_BYTES);
+CSL_STAT_ATTR(compr_raw, CSL_STAT_CZ_RAW);
+CSL_STAT_ATTR(compr_ns, CSL_STAT_CZ_NS);
+CSL_STAT_ATTR(dedup_lookups, CSL_STAT_DD_LOOKUPS);
+CSL_STAT_ATTR(dedup_hits, CSL_STAT_DD_HITS);
+
+static DEVICE_ATTR(waf, 0444, csl_waf_show, NULL);
+static DEVICE_ATTR(compr_ratio, 0444, csl_compr_ratio_show, NULL);
+static DEVICE_ATTR(compr_ns_per_gib, 0444, csl_compr_cost_show, NULL);
+static DEVICE_ATTR(dedup_hit_rate, 0444, csl_dedup_rate_show, NULL);
+
+static struct attribute *csl_stat_attrs[] = {
+	&csl_stat_reads.attr.attr,
+	&csl_stat_writes.attr.attr,
+	&csl_stat_read_bytes.attr.attr,
+	&csl_stat_write_bytes.attr.attr,
+	&csl_stat_map_inserts.attr.attr,
+	&csl_stat_map_updates.attr.attr,
+	&csl_stat_invalidates.attr.attr,
+	&csl_stat_trimmed.attr.attr,
+	&csl_stat_gc_calls.attr.attr,
+	&csl_stat_gc_reclaimed.attr.attr,
+	&csl_stat_alloc_fails.attr.attr,
+	&csl_stat_host_writes.attr.attr,
+	&csl_stat_zero_writes.attr.attr,
+	&csl_stat_media_writes.attr.attr,
+	&csl_stat_gc_writes.attr.attr,
+	&csl_stat_compr_pages.attr.attr,
+	&csl_stat_compr_bytes.attr.attr,
+	&csl_stat_compr_raw.attr.attr,
+	&csl_stat_compr_ns.attr.attr,
+	&csl_stat_dedup_lookups.attr.attr,
+	&csl_stat_dedup_hits.attr.attr,
+	&dev_attr_waf.attr,
+	&dev_attr_compr_ratio.attr,
+	&dev_attr_compr_ns_per_gib.attr,
+	&dev_attr_dedup_hit_rate.attr,
+	NULL,
+};
+
+static const struct attribute_group csl_stat_group = {
+	.name = "csl",
+	.attrs = csl_stat_attrs,
+};
+
+/* Passed to device_add_disk(), so the files come and go with the disk */
+const struct attribute_group *csl_attr_groups[] = {
+	&csl_stat_group,
+	NULL,
+};
+
+/* tracefs calls these when a timed event is enabled or disabled */
+int csl_trace_reg(void)
+{
+	atomic_inc(&csl_trace_users);
+	return SUCCESS_EXIT;
+}
+
+void csl_trace_unreg(void)
+{
+	atomic_dec(&csl_trace_users);
+}
+
+/*
+* csl_lat_start() : start timing a stage
+*
+* return : the time in ns, or 0 if neither the histograms nor a timed tracepoint want it
+*/
+u64 csl_lat_start(void)
+{
+	if(!READ_ONCE(latency_hist) && !atomic_read(&csl_trace_users)) return 0;
+
+	return ktime_get_ns();
+}
+
+/*
+* csl_lat_end() : stop timing a stage and count it in its histogram
+* @stage : the stage
+* @start : what csl_lat_start() returned
+*
+* return : the time of the stage in ns, 0 if it was not timed
+*/
+u64 csl_lat_end(enum csl_lat stage, u64 start)
+{
+	u64 ns;
+
+	if(!start) return 0;
+
+	ns = ktime_get_ns() - start;
+	if(READ_ONCE(latency_hist))
+		this_cpu_inc(dev->stats->hist[stage][ns ? min_t(unsigned int, ilog2(ns), CSL_HIST_BUCKETS - 1) : 0]);
+
+	return ns;
+}
+
+/*
+* csl_latency_show() : print the histogram of every stage, empty buckets are left out
+*/
+static int csl_latency_show(struct seq_file *m, void *v)
+{
+	u64 count;
+	int stage, i, cpu;
+
+	for(stage = 0; stage < CSL_NR_LAT; stage++){
+		seq_printf(m, "%s (ns)\n", csl_lat_names[stage]);
+
+		for(i = 0; i < CSL_HIST_BUCKETS; i++){
+			count = 0;
+			for_each_possible_cpu(cpu) count += per_cpu_ptr(dev->stats, cpu)->hist[stage][i];
+			if(count == 0) continue;
+
+			if(i == CSL_HIST_BUCKETS - 1) seq_printf(m, "  %10llu -            : %llu\n", 1ULL << i, count);
+			else seq_printf(m, "  %10llu - %10llu : %llu\n", i ? 1ULL << i : 0, (1ULL << (i + 1)) - 1, count);
+		}
+	}
+
+	return SUCCESS_EXIT;
+}
+DEFINE_SHOW_ATTRIBUTE(csl_latency);
+
+/*
+* csl_debugfs_init() : create debugfs csl/latency
+*
+* debugfs is optional, the device works the same if it is missing.
+*/
+void csl_debugfs_init(void)
+{
+	csl_debugfs = debugfs_create_dir("csl", NULL);
+	debugfs_create_file("latency", 0444, csl_debugfs, NULL, &csl_latency_fops);
+}
+
+void csl_debugfs_exit(void)
+{
+	debugfs_remove_recursive(csl_debugfs);
+	csl_debugfs = NULL;
+}